@@ -5,11 +5,21 @@
 #include <type_traits>
 #include <any>
 #include <vector>
+#include <array>
 #include <map>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
 #include <functional>
+#include <optional>
+#include <variant>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <ranges>
+#include <atomic>
 
 #include <lua/lua.hpp>
 
@@ -23,6 +33,14 @@ namespace luas
 	struct lua_fn;
 	class variadic_args;
 	class state;
+
+	template <typename T>
+	class array_view;
+
+	class value;
+
+	template <typename... Ctors>
+	struct constructors;
 }
 
 extern "C"
@@ -37,6 +55,19 @@ extern "C"
 
 #define TYPEINFO(x) const_cast<std::type_info*>(&typeid(x))
 
+// when enabled, bindings using the trusted policy don't validate the
+// type of their arguments in release builds
+//
+#ifndef LUAS_UNCHECKED_TRUSTED_RELEASE
+#define LUAS_UNCHECKED_TRUSTED_RELEASE 0
+#endif
+
+#if LUAS_UNCHECKED_TRUSTED_RELEASE && defined(NDEBUG)
+#define LUAS_VALIDATE_TRUSTED 0
+#else
+#define LUAS_VALIDATE_TRUSTED 1
+#endif
+
 template <typename... A>
 inline void check_fatal(bool condition, const char* text, A... args)
 {
@@ -59,6 +90,34 @@ namespace luas
 		bool second;
 	};
 
+	/*
+	* conversion policies for bindings, checked is the default one and
+	* validates every argument before converting it, trusted converts
+	* scalars with a single lua_toXx call
+	*/
+	struct checked {};
+	struct trusted {};
+
+	template <typename M>
+	struct reflected_member
+	{
+		const char* name;
+		M ptr;
+	};
+
+	template <typename M>
+	constexpr reflected_member<M> member(const char* name, M ptr) { return { name, ptr }; }
+
+	/*
+	* specialize to convert a struct to and from a table, members is a
+	* tuple of luas::member entries:
+	* 
+	* template <>
+	* struct luas::reflect<hit> { static constexpr auto members = std::make_tuple(luas::member("pos", &hit::pos)); };
+	*/
+	template <typename T>
+	struct reflect {};
+
 	namespace detail
 	{
 		template <typename, template <typename...> typename>
@@ -73,6 +132,15 @@ namespace luas
 		template <typename T>
 		concept is_tuple = is_specialization<T, std::tuple>::value;
 
+		template <typename T>
+		concept is_pair = is_specialization<T, std::pair>::value;
+
+		template <typename T>
+		concept is_optional = is_specialization<T, std::optional>::value;
+
+		template <typename T>
+		concept is_variant = is_specialization<T, std::variant>::value;
+
 		template <typename T>
 		concept is_string_array = std::is_array_v<std::remove_cvref_t<T>> && std::is_same_v<std::remove_all_extents_t<std::remove_cvref_t<T>>, char>;
 
@@ -80,7 +148,7 @@ namespace luas
 		concept is_string_ptr = std::is_pointer_v<T> && std::is_same_v<std::remove_cvref_t<std::remove_pointer_t<T>>, char>;
 
 		template <typename T>
-		concept is_string = std::is_same_v<T, std::string> || is_string_ptr<T> || is_string_array<T>;
+		concept is_string = std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view> || is_string_ptr<T> || is_string_array<T>;
 
 		template <typename T>
 		concept is_bool = std::is_same_v<T, bool>;
@@ -95,7 +163,7 @@ namespace luas
 		concept is_state = std::is_same_v<T, state>;
 
 		template <typename T>
-		concept is_userdata = std::is_pointer_v<T>;
+		concept is_userdata = std::is_pointer_v<T> && !is_string_ptr<T>;
 
 		template <typename T>
 		concept is_vector = is_specialization<T, std::vector>::value && !std::is_same_v<typename T::value_type, std::any>;
@@ -109,6 +177,93 @@ namespace luas
 		template <typename T>
 		concept is_map = is_specialization<T, std::map>::value || is_specialization<T, std::unordered_map>::value;
 
+		template <typename T>
+		concept is_array_view = is_specialization<T, array_view>::value;
+
+		template <typename T>
+		concept is_reflected = requires { reflect<T>::members; };
+
+		template <typename T>
+		concept is_value = std::is_same_v<T, value>;
+
+		template <typename T>
+		concept is_constructors = is_specialization<T, constructors>::value;
+
+		/*
+		* types pointing to a string owned by lua, they are only valid
+		* while the string is on the stack
+		*/
+		template <typename T>
+		constexpr bool borrows_string()
+		{
+			if constexpr (std::is_same_v<T, std::string_view> || is_string_ptr<T>)	return true;
+			else if constexpr (is_optional<T> || is_vector<T> || is_set<T>)			return borrows_string<typename T::value_type>();
+			else if constexpr (is_map<T>)	return borrows_string<typename T::key_type>() || borrows_string<typename T::mapped_type>();
+			else if constexpr (is_tuple<T> || is_pair<T>)
+			{
+				return []<size_t... I>(std::index_sequence<I...>)
+				{
+					return (borrows_string<std::tuple_element_t<I, T>>() || ...);
+				}(std::make_index_sequence<std::tuple_size_v<T>>());
+			}
+			else if constexpr (is_variant<T>)
+			{
+				return []<size_t... I>(std::index_sequence<I...>)
+				{
+					return (borrows_string<std::variant_alternative_t<I, T>>() || ...);
+				}(std::make_index_sequence<std::variant_size_v<T>>());
+			}
+			else return false;
+		}
+
+		/*
+		* lua types as bits so a value's type can be tested against the
+		* types a parameter accepts, integers have an extra bit on top
+		* of the number one
+		*/
+		inline constexpr uint32_t type_bit(int type) { return 1u << (type + 1); }
+
+		inline constexpr uint32_t integer_bit = 1u << 16;
+
+		template <typename T>
+		constexpr uint32_t type_mask()
+		{
+			if constexpr (is_bool<T>)						return type_bit(LUA_TBOOLEAN);
+			else if constexpr (is_integer<T>)				return integer_bit;
+			else if constexpr (std::is_floating_point_v<T>) return type_bit(LUA_TNUMBER);
+			else if constexpr (is_string<T>)				return type_bit(LUA_TSTRING);
+			else if constexpr (is_userdata<T>)				return type_bit(LUA_TNIL) | type_bit(LUA_TLIGHTUSERDATA) | type_bit(LUA_TUSERDATA);
+			else if constexpr (std::is_same_v<T, lua_fn>)	return type_bit(LUA_TNIL) | type_bit(LUA_TFUNCTION);
+			else if constexpr (is_vector<T> || is_set<T> || is_map<T> || is_reflected<T>) return type_bit(LUA_TTABLE);
+			else if constexpr (std::is_same_v<T, std::monostate>) return type_bit(LUA_TNONE) | type_bit(LUA_TNIL);
+			else if constexpr (is_value<T>)					return ~0u;
+			else if constexpr (is_tuple<T> || is_pair<T>)
+			{
+				// a tuple spans one argument per element, the mask only
+				// covers the first one (see param_masks)
+
+				if constexpr (std::tuple_size_v<T> == 0)	return type_bit(LUA_TNONE);
+				else										return type_mask<std::remove_cvref_t<std::tuple_element_t<0, T>>>();
+			}
+			else if constexpr (is_optional<T>)				return type_bit(LUA_TNONE) | type_bit(LUA_TNIL) | type_mask<typename T::value_type>();
+			else if constexpr (is_variant<T>)
+			{
+				return []<size_t... I>(std::index_sequence<I...>)
+				{
+					return (type_mask<std::variant_alternative_t<I, T>>() | ...);
+				}(std::make_index_sequence<std::variant_size_v<T>>());
+			}
+			else											return type_bit(LUA_TUSERDATA);
+		}
+
+		// types only lua userdata can hold, such as registered classes
+
+		template <typename T>
+		concept is_object = std::is_class_v<T> && !std::is_same_v<T, variadic_args> && !is_tuple<T> && !is_pair<T> && !is_array_view<T> && type_mask<T>() == type_bit(LUA_TUSERDATA);
+
+		template <typename T>
+		concept is_object_ref = std::is_lvalue_reference_v<T> && is_object<std::remove_cvref_t<T>>;
+
 		template <typename T>
 		struct fn_return_type { using type = T; };
 
@@ -175,24 +330,6 @@ namespace luas
 		template <typename T>
 		using remove_member_ptr_fn_v = remove_member_ptr_fn<T>::type;
 
-		template <typename T>
-		struct keep_member_ptr_fn { using type = void; };
-
-		template <typename T, typename R, typename... A>
-		struct keep_member_ptr_fn<R(T::*)(A...)> { using type = R(__thiscall*)(T*, A...); };
-
-		template <typename T, typename R, typename... A>
-		struct keep_member_ptr_fn<R(T::*)(A...) const> { using type = R(__thiscall*)(T*, A...); };
-
-		template <typename T, typename R, typename... A>
-		struct keep_member_ptr_fn<R(T::*)(A...) volatile> { using type = R(__thiscall*)(T*, A...); };
-
-		template <typename T, typename R, typename... A>
-		struct keep_member_ptr_fn<R(T::*)(A...) const volatile> { using type = R(__thiscall*)(T*, A...); };
-
-		template <typename T>
-		using keep_member_ptr_fn_v = keep_member_ptr_fn<T>::type;
-
 		template <typename T>
 		struct first_arg_member_fn { using type = void; };
 
@@ -211,6 +348,16 @@ namespace luas
 		template <typename T>
 		struct function_type { using type = std::decay<typename remove_member_ptr_fn<decltype(&std::decay_t<T>::operator())>::type>::type; };
 
+		template <typename R, typename... A>
+		struct function_type<R(*)(A...)> { using type = R(*)(A...); };
+
+		template <typename T>
+		concept is_policy = std::is_same_v<T, checked> || std::is_same_v<T, trusted>;
+
+		template <typename T>
+		concept is_stateless_fn = std::is_class_v<T> && std::is_empty_v<T> && std::is_default_constructible_v<T>;
+
+
 		template <typename T>
 		using function_type_v = function_type<T>::type;
 
@@ -255,11 +402,113 @@ namespace luas
 		template <typename T>
 		using remove_cvref_t = remove_cvref<T>::type;
 
+		/*
+		* parameters of a function as seen from lua (without the state&
+		* parameter), used to pick an overload by the types of the arguments
+		*/
+		template <size_t... N>
+		constexpr auto concat_masks(const std::array<uint32_t, N>&... masks)
+		{
+			std::array<uint32_t, (N + ... + 0)> out {};
+
+			size_t n = 0;
+
+			([&](const auto& m) { for (auto mask : m) out[n++] = mask; }(masks), ...);
+
+			return out;
+		}
+
+		/*
+		* masks of the arguments a parameter reads, tuples and pairs
+		* read one argument per element
+		*/
+		template <typename T>
+		constexpr auto param_masks()
+		{
+			if constexpr (is_tuple<T> || is_pair<T>)
+			{
+				return []<size_t... I>(std::index_sequence<I...>)
+				{
+					return concat_masks(param_masks<std::remove_cvref_t<std::tuple_element_t<I, T>>>()...);
+				}(std::make_index_sequence<std::tuple_size_v<T>>());
+			}
+			else return std::array<uint32_t, 1> { type_mask<T>() };
+		}
+
 		template <typename T>
-		concept does_ret_type_fit_in_eax = std::is_integral_v<T> || std::is_floating_point_v<T> || std::is_pointer_v<T>;
+		struct fn_signature {};
+
+		template <typename R, typename... A>
+		struct fn_signature<R(*)(A...)>
+		{
+			static constexpr bool variadic = (std::is_same_v<std::remove_cvref_t<A>, variadic_args> || ...);
+			static constexpr auto masks = concat_masks(param_masks<std::remove_cvref_t<A>>()..., std::array<uint32_t, 1> { 0u });
+			static constexpr int arity = static_cast<int>(masks.size()) - 1 - (variadic ? 1 : 0);
+
+			// missing arguments have the none bit set so only trailing
+			// optionals can be left out
+
+			static constexpr bool match(const uint32_t* types, int nargs)
+			{
+				if (!variadic && nargs > arity)
+					return false;
+
+				for (int i = 0; i < arity; ++i)
+					if (!(types[i] & masks[i]))
+						return false;
+
+				return true;
+			}
+		};
+
+		template <typename R, typename... A>
+		struct fn_signature<R(*)(state&, A...)> : public fn_signature<R(*)(A...)> {};
+
+		// constructor signatures
+
+		template <typename R, typename... A>
+		struct fn_signature<R(A...)> : public fn_signature<R(*)(A...)> {};
+
+		template <typename... Fns>
+		struct overload_set
+		{
+			std::tuple<Fns...> fns;
+		};
+
+		/*
+		* offset of a base class inside an object of a derived class, it
+		* doesn't work with virtual bases
+		*/
+		template <typename D, typename B>
+		ptrdiff_t base_offset()
+		{
+			static_assert(std::is_base_of_v<B, D>, "Type is not a base of the class");
+			static_assert(requires (B* b) { static_cast<D*>(b); }, "Virtual bases are not supported");
+
+			alignas(D) unsigned char storage[sizeof(D)];
+
+			const auto derived = reinterpret_cast<D*>(storage);
+
+			return reinterpret_cast<char*>(static_cast<B*>(derived)) - reinterpret_cast<char*>(derived);
+		}
+
+		// lua aligns userdata blocks to LUAI_MAXALIGN
+
+		union userdata_align { LUAI_MAXALIGN; };
+
+		/*
+		* sequential id for each type, used to index the registered
+		* classes without hashing, atomic since contexts can be
+		* created on several threads at once
+		*/
+		inline std::atomic<uint32_t> next_type_id = 0;
 
 		template <typename T>
-		using aligned_storage = std::aligned_storage_t<sizeof(T), alignof(T)>;
+		uint32_t type_id()
+		{
+			static const uint32_t id = next_type_id.fetch_add(1, std::memory_order_relaxed);
+			return id;
+		}
 	}
 
 	namespace tuple
@@ -293,372 +542,1200 @@ namespace luas
 		}
 	}
 
-	struct property_wrapper_base {};
-
-	template <typename S, typename G>
-	struct property_wrapper : public property_wrapper_base
+	/*
+	* non-owning view over contiguous C++ memory pushed to lua as a small
+	* userdata, elements are read and written in place. a view over a
+	* vector follows the vector so it can be resized without pushing the
+	* view again
+	*/
+	template <typename T>
+	class array_view
 	{
-		std::string key;
+	private:
 
-		S s;
-		G g;
+		static_assert(!std::is_same_v<T, bool>, "std::vector<bool> is not contiguous");
 
-		template <typename Sx, typename Gx>
-		property_wrapper(const std::string& key, Sx&& s, Gx&& g) : key(key), s(std::move(s)), g(std::move(g)) {}
-	};
+		std::vector<T>* container = nullptr;
 
-	template <typename S, typename G>
-	inline auto property(const std::string& key, S&& s, G&& g)
-	{
-		return property_wrapper<std::decay_t<S>, std::decay_t<G>>(key, std::forward<S>(s), std::forward<G>(g));
-	}
+		T* ptr = nullptr;
 
-	struct function_wrapper_base {};
+		size_t count = 0;
 
-	template <typename T>
-	struct function_wrapper : public function_wrapper_base
-	{
-		std::string key;
+		bool read_only = false;
 
-		T value;
+	public:
 
-		template <typename T>
-		function_wrapper(const std::string& key, T&& v) : key(key), value(std::move(v)) {}
+		using value_type = T;
+
+		array_view() {}
+		array_view(std::vector<T>& v, bool read_only = false) : container(&v), read_only(read_only) {}
+		array_view(std::span<T> v, bool read_only = false) : ptr(v.data()), count(v.size()), read_only(read_only) {}
+
+		T* data() const { return container ? container->data() : ptr; }
+
+		size_t size() const { return container ? container->size() : count; }
+
+		bool is_read_only() const { return read_only; }
 	};
 
-	template <typename T>
-	inline auto function(const std::string& key, T&& v)
+	/*
+	* userdata referencing an object stored in C++, get returns its
+	* address or null when it doesn't exist anymore
+	*/
+	struct object_ref
 	{
-		return function_wrapper<std::decay_t<T>>(key, std::forward<T>(v));
-	}
+		void* (*get)(const object_ref* ref) = nullptr;
+	};
 
-	struct member_access_fns
+	// element of an array view, it's looked up on every access so the
+	// storage of the view can still be resized
+
+	template <typename T>
+	struct element_ref : public object_ref
 	{
-		void* write = nullptr,
-			* read = nullptr;
+		array_view<T> view;
 
-		member_access_fns() {}
+		size_t index = 0;
 
-		template <typename S, typename G>
-		member_access_fns(S&& s, G&& g)
+		element_ref(const array_view<T>& view, size_t index) : view(view), index(index)
 		{
-			write = std::bit_cast<void*>(std::move(s));
-			read = std::bit_cast<void*>(std::move(g));
+			get = [](const object_ref* ref) -> void*
+			{
+				const auto element = static_cast<const element_ref*>(ref);
+
+				return element->index < element->view.size() ? element->view.data() + element->index : nullptr;
+			};
 		}
 	};
 
-	class state_info
+	/*
+	* dynamic lua value, scalars and short strings are stored inline,
+	* long strings on the heap and any other lua value (tables,
+	* functions, userdata) as a registry reference
+	*/
+	class value
 	{
-	private:
+	public:
 
-		class oop_class
+		enum class type : uint8_t
 		{
-		public:
-
-			std::string name;
+			nil,
+			boolean,
+			integer,
+			number,
+			string,
+			userdata,
+			ref,
+		};
 
-		private:
+		static constexpr size_t inline_capacity = 24;
 
-			std::unordered_map<std::string, member_access_fns> fields;
-			std::unordered_map<type_info*, void*> functions;
+	private:
 
-		public:
+		friend class state;
 
-			member_access_fns* get_field_info(const std::string& key)
-			{
-				auto it = fields.find(key);
-				return it != fields.end() ? &it->second : nullptr;
-			}
+		union
+		{
+			bool b;
+			lua_Integer i;
+			lua_Number n;
+			void* p;
+			char* heap;
+			char str[inline_capacity];
 
-			void* get_function(type_info* type)
+			struct
 			{
-				auto it = functions.find(type);
-				return it != functions.end() ? it->second : nullptr;
-			}
-
-			template <typename T>
-			void add_function(type_info* type, T&& v) { functions[type] = std::bit_cast<void*>(std::move(v)); }
-
-			template <typename S, typename G>
-			void add_field(const std::string& key, S&& setter, G&& getter) { fields[key] = member_access_fns(setter, getter); }
+				lua_State* L;
+				int id;
+			} ref;
 		};
 
-		std::unordered_map<type_info*, oop_class> classes;
-
-	public:
+		uint32_t len = 0;
 
-		oop_class* add_class(type_info* type) { return &classes[type]; }
+		type t = type::nil;
 
-		oop_class* get_class(type_info* type)
+		void set_string(std::string_view v)
 		{
-			auto it = classes.find(type);
-			return it != classes.end() ? &it->second : nullptr;
-		}
+			len = static_cast<uint32_t>(v.size());
 
-		bool has_class(type_info* type) const { return classes.contains(type); }
-	};
+			if (len > inline_capacity)
+			{
+				heap = new char[len];
+				std::memcpy(heap, v.data(), len);
+			}
+			else std::memcpy(str, v.data(), len);
 
-	inline std::unordered_map<lua_State*, state_info> states_info;
+			t = type::string;
+		}
 
-	class state
-	{
-	public:
+		// takes the value on top of the stack
 
-		static inline void _on_error(lua_State* vm, const std::string& err)
+		void set_ref(lua_State* L)
 		{
-			lua_Debug dbg;
-
-			lua_getstack(vm, 1, &dbg);
-			lua_getinfo(vm, ">nSl", &dbg);
+			// the main thread outlives any coroutine the value may come from
 
-			std::string dbg_info;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
 
-			if (dbg.name)					dbg_info = FORMATV("[Fn: {}, Line {}] {}", dbg.name, dbg.currentline, err);
-			else if (dbg.currentline != -1) dbg_info = FORMATV("[Line {}] {}", dbg.currentline, err);
-			else							dbg_info = FORMATV("{}", err);
+			ref.L = lua_tothread(L, -1);
 
-			error_callback(dbg_info.c_str());
-		}
+			lua_pop(L, 1);
 
-		lua_State* _state = nullptr;
+			ref.id = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	private:
+			t = type::ref;
+		}
 
-		template <typename ObjType>
-		struct ctor_caller
+		void copy(const value& other)
 		{
-			template <typename... A, typename... In>
-			static void _impl(state& _s, In&&... args) requires (detail::is_empty_args<A...>)
+			switch (t = other.t)
 			{
-				new (_s.new_userdata<ObjType>()) ObjType(args...);
+			case type::string: set_string(other.as_string()); break;
+			case type::ref:
+				lua_rawgeti(other.ref.L, LUA_REGISTRYINDEX, other.ref.id);
+				set_ref(other.ref.L);
+				break;
+			default: std::memcpy(str, other.str, sizeof(str)); len = other.len;
 			}
+		}
 
-			template <typename T, typename... A, typename... In>
-			static void _impl(state& _s, In&&... args)
-			{
-				using type = detail::remove_cvref_t<T>;
+		void move(value& other)
+		{
+			std::memcpy(str, other.str, sizeof(str));
 
-				type value; _s.pop(value);
+			len = other.len;
+			t = std::exchange(other.t, type::nil);
+		}
 
-				_impl<A...>(_s, std::forward<type>(value), std::forward<In>(args)...);
-			}
+	public:
 
-			template <typename T>
-			struct caller { using type = T; };
+		value() {}
+		value(std::nullptr_t) {}
+		value(bool v) : b(v), t(type::boolean) {}
+		value(lua_Number v) : n(v), t(type::number) {}
+		value(void* v) : p(v), t(v ? type::userdata : type::nil) {}
+		value(const char* v) { set_string(v); }
+		value(std::string_view v) { set_string(v); }
+		value(const std::string& v) { set_string(v); }
 
-			template <typename R, typename... A>
-			struct caller<R(A...)>
-			{
-				static void _do(state& _s) { _impl<A...>(_s); }
-			};
+		template <typename T>
+		value(T v) requires(detail::is_integer<T>) : i(static_cast<lua_Integer>(v)), t(type::integer) {}
 
-			template <typename Ctor>
-			static void call(state& _s) { caller<Ctor>::_do(_s); }
-		};
+		value(const value& other) { copy(other); }
+		value(value&& other) noexcept { move(other); }
 
-		template <typename T>
-		struct class_fn_caller { using type = T; };
+		~value() { reset(); }
 
-		template <typename R, typename Tx, typename... A>
-		struct class_fn_caller<R(__thiscall*)(Tx*, A...)>
+		value& operator=(const value& other)
 		{
-			template <typename... Args, typename... In>
-			static int _impl(state& _s, void* fn, Tx* _this, In&&... args) requires (detail::is_empty_args<Args>)
+			if (this != &other)
 			{
-				if constexpr (std::is_void_v<R>)
-					std::bit_cast<R(__thiscall*)(Tx*, A...)>(fn)(_this, args...);
-				else if constexpr (detail::does_ret_type_fit_in_eax<R>)
-					return _s.push(std::bit_cast<R(__thiscall*)(Tx*, A...)>(fn)(_this, args...));
-				else
-				{
-					using _R = detail::aligned_storage<R>;
-
-					_R out;
+				reset();
+				copy(other);
+			}
 
-					const auto ret = std::bit_cast<_R* (__thiscall*)(Tx*, _R*, A&&...)>(fn)(_this, &out, std::forward<A>(args)...);
+			return *this;
+		}
 
-					// the memory for the return value is not allocated so just call the dtor
+		value& operator=(value&& other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				move(other);
+			}
 
-					const auto casted_ret = std::bit_cast<R*>(ret);
+			return *this;
+		}
 
-					int c = _s.push(*casted_ret);
+		void reset()
+		{
+			if (t == type::string && len > inline_capacity)
+				delete[] heap;
+			else if (t == type::ref)
+				luaL_unref(ref.L, LUA_REGISTRYINDEX, ref.id);
 
-					casted_ret->~R();
+			t = type::nil;
+			len = 0;
+		}
 
-					return c;
-				}
+		type get_type() const { return t; }
 
-				return 0;
-			}
+		bool is_nil() const { return t == type::nil; }
 
-			template <typename T, typename... Args, typename... In>
-			static int _impl(state& _s, void* fn, Tx* _this, In&&... args)
-			{
-				using type = detail::remove_cvref_t<T>;
+		bool as_bool() const { return t == type::boolean ? b : t != type::nil; }
 
-				type value; _s.pop(value);
+		lua_Integer as_int() const { return t == type::integer ? i : t == type::number ? static_cast<lua_Integer>(n) : 0; }
 
-				return _impl<Args...>(_s, fn, _this, std::forward<In>(args)..., std::forward<type>(value));
-			}
+		lua_Number as_number() const { return t == type::number ? n : t == type::integer ? static_cast<lua_Number>(i) : 0.0; }
 
-			static int call(state& _s, void* fn)
-			{
-				variadic_arg_check<A...>();
+		std::string_view as_string() const
+		{
+			if (t != type::string)
+				return {};
 
-				Tx* _this; _s.pop(_this);
+			return { len > inline_capacity ? heap : str, len };
+		}
 
-				return _impl<A...>(_s, fn, _this);
-			}
-		};
+		void* as_userdata() const { return t == type::userdata ? p : nullptr; }
+	};
 
-		static constexpr auto OOP_CREATE_FN_NAME() { return "create"; }
+	struct property_wrapper_base {};
 
-		template <typename T = int, typename... A>
-		static T _throw_error(lua_State* vm, const std::string& err, const A&... args) { _on_error(vm, FORMATV(err, args...)); return T{}; }
+	template <typename S, typename G>
+	struct property_wrapper : public property_wrapper_base
+	{
+		std::string key;
+
+		S s;
+		G g;
+
+		template <typename Sx, typename Gx>
+		property_wrapper(const std::string& key, Sx&& s, Gx&& g) : key(key), s(std::move(s)), g(std::move(g)) {}
+	};
+
+	template <typename S, typename G>
+	inline auto property(const std::string& key, S&& s, G&& g)
+	{
+		return property_wrapper<std::decay_t<S>, std::decay_t<G>>(key, std::forward<S>(s), std::forward<G>(g));
+	}
+
+	struct field_wrapper_base {};
+
+	struct read_only_t {};
+
+	inline constexpr read_only_t read_only {};
+
+	template <typename M, bool ReadOnly>
+	struct field_wrapper : public field_wrapper_base
+	{
+		static constexpr bool read_only = ReadOnly;
+
+		std::string key;
+
+		M value;
 
-		static int read_only(lua_State* L)
+		field_wrapper(const std::string& key, M v) : key(key), value(v) {}
+	};
+
+	template <typename M>
+	inline auto field(const std::string& key, M v)
+	{
+		return field_wrapper<M, false>(key, v);
+	}
+
+	template <typename M>
+	inline auto field(const std::string& key, M v, read_only_t)
+	{
+		return field_wrapper<M, true>(key, v);
+	}
+
+	struct function_wrapper_base {};
+
+	template <typename T, typename P>
+	struct function_wrapper : public function_wrapper_base
+	{
+		using policy = P;
+
+		std::string key;
+
+		T value;
+
+		template <typename T>
+		function_wrapper(const std::string& key, T&& v) : key(key), value(std::move(v)) {}
+	};
+
+	template <typename P = checked, typename T>
+	inline auto function(const std::string& key, T&& v)
+	{
+		return function_wrapper<std::decay_t<T>, P>(key, std::forward<T>(v));
+	}
+
+	/*
+	* base class of a registered class, the base must be registered
+	* first and its methods and properties are copied to the class
+	*/
+	struct base_wrapper_base {};
+
+	/*
+	* list of constructor signatures of a class, used as the
+	* constructor of register_class
+	*/
+	template <typename... Ctors>
+	struct constructors {};
+
+	template <typename B>
+	struct base_wrapper : public base_wrapper_base
+	{
+		using type = B;
+	};
+
+	template <typename B>
+	inline constexpr base_wrapper<B> base {};
+
+	/*
+	* objects of classes registered with this flag are moved out of
+	* lua when collected and destroyed in batch by
+	* ctx::flush_destructors, so heavy destructors don't run
+	* during the garbage collection
+	*/
+	struct deferred_destroy_t {};
+
+	inline constexpr deferred_destroy_t deferred_destroy {};
+
+	/*
+	* operators of a class installed as metamethods, they call the
+	* C++ operator of the class (or to_string/size for tostring and
+	* len). arithmetic operators also take a number on either side
+	* when the class has an operator for it
+	*/
+	enum class operator_type
+	{
+		add,
+		sub,
+		mul,
+		eq,
+		lt,
+		le,
+		unm,
+		len,
+		tostring,
+	};
+
+	struct operator_wrapper_base {};
+
+	template <operator_type O>
+	struct operator_wrapper : public operator_wrapper_base
+	{
+		static constexpr operator_type type = O;
+	};
+
+	inline constexpr operator_wrapper<operator_type::add> op_add {};
+	inline constexpr operator_wrapper<operator_type::sub> op_sub {};
+	inline constexpr operator_wrapper<operator_type::mul> op_mul {};
+	inline constexpr operator_wrapper<operator_type::eq> op_eq {};
+	inline constexpr operator_wrapper<operator_type::lt> op_lt {};
+	inline constexpr operator_wrapper<operator_type::le> op_le {};
+	inline constexpr operator_wrapper<operator_type::unm> op_unm {};
+	inline constexpr operator_wrapper<operator_type::len> op_len {};
+	inline constexpr operator_wrapper<operator_type::tostring> op_tostring {};
+
+	/*
+	* property accessor stored as a light userdata in the class' member
+	* table, __index and __newindex call it directly with the object
+	* at stack index 1, the key at 2 and the new value at 3
+	*/
+	struct member_access_fns
+	{
+		virtual ~member_access_fns() {}
+
+		virtual int read(lua_State* L, void* obj) const { return luaL_error(L, "Property %s is write-only", lua_tostring(L, 2)); }
+		virtual int write(lua_State* L, void* obj) const { return luaL_error(L, "Property %s is read-only", lua_tostring(L, 2)); }
+	};
+
+	/*
+	* accessor of a base class inherited by a class where the base
+	* doesn't start at the beginning of the object
+	*/
+	struct offset_access_fns : public member_access_fns
+	{
+		const member_access_fns* base;
+
+		ptrdiff_t offset;
+
+		offset_access_fns(const member_access_fns* base, ptrdiff_t offset) : base(base), offset(offset) {}
+
+		int read(lua_State* L, void* obj) const override { return base->read(L, static_cast<char*>(obj) + offset); }
+		int write(lua_State* L, void* obj) const override { return base->write(L, static_cast<char*>(obj) + offset); }
+	};
+
+	struct deferred_objects_base
+	{
+		virtual ~deferred_objects_base() {}
+
+		virtual void flush() = 0;
+	};
+
+	template <typename T>
+	struct deferred_objects : public deferred_objects_base
+	{
+		std::vector<T> objects;
+
+		void flush() override { objects.clear(); }
+	};
+
+	class state_info
+	{
+	public:
+
+		class oop_class
 		{
-			luaL_error(L, "Property %s is read-only", lua_tostring(L, lua_upvalueindex(1)));
-			lua_pushnil(L);
-			return 1;
+		public:
+
+			std::string name;
+
+			// registry reference of the class' metatable
+
+			int ref = LUA_NOREF;
+
+			// metatable of the references to objects of the class (see
+			// object_ref), created the first time one is pushed
+
+			int ref_mt = LUA_NOREF;
+
+			// collected objects waiting to be destroyed (deferred_destroy)
+
+			std::unique_ptr<deferred_objects_base> deferred;
+
+		private:
+
+			std::vector<std::unique_ptr<member_access_fns>> members;
+
+		public:
+
+			template <typename T, typename... A>
+			T* add_member(A&&... args)
+			{
+				auto member = new T(std::forward<A>(args)...);
+
+				members.emplace_back(member);
+
+				return member;
+			}
+		};
+
+	private:
+
+		std::vector<std::unique_ptr<oop_class>> classes;	// indexed by detail::type_id
+
+	public:
+
+		// watched globals (see state::watch_global), the version is
+		// increased every time a script assigns one of them
+
+		int watched_names_ref = LUA_NOREF,
+			watched_values_ref = LUA_NOREF;
+
+		uint64_t globals_version = 0;
+
+		template <typename T>
+		oop_class* add_class()
+		{
+			const auto id = detail::type_id<T>();
+
+			if (id >= classes.size())
+				classes.resize(id + 1);
+
+			classes[id] = std::make_unique<oop_class>();
+
+			return classes[id].get();
 		}
 
-		static int write_only(lua_State* L)
+		template <typename T>
+		oop_class* get_class() const
 		{
-			luaL_error(L, "Property %s is write-only", lua_tostring(L, lua_upvalueindex(1)));
-			lua_pushnil(L);
-			return 1;
+			const auto id = detail::type_id<T>();
+			return id < classes.size() ? classes[id].get() : nullptr;
 		}
 
-		static int oop_obj_create(lua_State* L)
+		template <typename T>
+		bool has_class() const { return !!get_class<T>(); }
+
+		void flush_deferred()
 		{
-			state s(L);
+			for (const auto& class_info : classes)
+				if (class_info && class_info->deferred)
+					class_info->deferred->flush();
+		}
+	};
+
+	static_assert(LUA_EXTRASPACE >= sizeof(state_info*), "LUA_EXTRASPACE must fit a pointer");
+
+	class state
+	{
+	public:
+
+		static inline void _on_error(lua_State* vm, const std::string& err)
+		{
+			lua_Debug dbg {};
+
+			dbg.currentline = -1;
+
+			// getinfo must not use '>' here, it would pop the top of the stack
+
+			if (lua_getstack(vm, 1, &dbg))
+				lua_getinfo(vm, "nSl", &dbg);
+
+			std::string dbg_info;
+
+			if (dbg.name)					dbg_info = FORMATV("[Fn: {}, Line {}] {}", dbg.name, dbg.currentline, err);
+			else if (dbg.currentline != -1) dbg_info = FORMATV("[Line {}] {}", dbg.currentline, err);
+			else							dbg_info = FORMATV("{}", err);
+
+			error_callback(dbg_info.c_str());
+		}
+
+		lua_State* _state = nullptr;
+
+	private:
+
+		template <typename ObjType>
+		struct ctor_caller
+		{
+			template <typename... A, typename... In>
+			static int _impl(state& _s, [[maybe_unused]] int i, In&&... args) requires (detail::is_empty_args<A...>)
+			{
+				new (_s.new_userdata<ObjType>()) ObjType(std::forward<In>(args)...);
+
+				return 1;
+			}
+
+			template <typename T, typename... A, typename... In>
+			static int _impl(state& _s, int i, In&&... args)
+			{
+				return _s.template read_arg<T, checked>(i, [&](auto&& arg, int next)
+				{
+					return _impl<A...>(_s, next, std::forward<In>(args)..., std::forward<decltype(arg)>(arg));
+				});
+			}
+
+			template <typename T>
+			struct caller { using type = T; };
+
+			template <typename R, typename... A>
+			struct caller<R(A...)>
+			{
+				static int _do(state& _s, int i) { return _impl<A...>(_s, i); }
+			};
+
+			/*
+			* picks the first constructor accepting the arguments, the type
+			* masks of every signature are computed at compile time
+			*/
+			template <typename... Ctors>
+			static int dispatch(state& _s, int i, int nargs, constructors<Ctors...>)
+			{
+				constexpr int max_arity = std::max({ 0, detail::fn_signature<Ctors>::arity... });
+
+				uint32_t types[max_arity + 1] = {};
+
+				for (int n = 0; n < max_arity; ++n)
+					types[n] = n < nargs ? _s.get_type_bits(i + n) : detail::type_bit(LUA_TNONE);
+
+				int result = 0;
+
+				if (((detail::fn_signature<Ctors>::match(types, nargs) && (result = caller<Ctors>::_do(_s, i), true)) || ...))
+					return result;
+
+				return _s.throw_error("No constructor matches the arguments");
+			}
+
+			// constructs the object with the arguments from index i to the top
+
+			template <typename Ctor>
+			static int call(state& _s, int i)
+			{
+				if constexpr (detail::is_constructors<Ctor>)
+					return dispatch(_s, i, _s.get_top() - i + 1, Ctor {});
+				else return caller<Ctor>::_do(_s, i);
+			}
+		};
+
+		/*
+		* calls a bound method, the member function pointer is stored
+		* in the closure's upvalue so there is no lookup involved, ObjType
+		* is the registered class and Tx the class of the method
+		*/
+		template <typename P, typename M, typename ObjType, typename Tx, typename R, typename... A>
+		struct class_method_caller_impl
+		{
+			template <typename... Args, typename... In>
+			static int _impl(state& _s, M fn, Tx* _this, [[maybe_unused]] int i, In&&... args) requires (detail::is_empty_args<Args...>)
+			{
+				if constexpr (std::is_void_v<R>)
+					(_this->*fn)(std::forward<In>(args)...);
+				else
+					return _s.push((_this->*fn)(std::forward<In>(args)...));
 
-			if (!s.is_table(1))
 				return 0;
+			}
+
+			template <typename T, typename... Args, typename... In>
+			static int _impl(state& _s, M fn, Tx* _this, int i, In&&... args)
+			{
+				return _s.template read_arg<T, P>(i, [&](auto&& arg, int next)
+				{
+					return _impl<Args...>(_s, fn, _this, next, std::forward<In>(args)..., std::forward<decltype(arg)>(arg));
+				});
+			}
+
+			static int call(lua_State* L)
+			{
+				variadic_arg_check<A...>();
+
+				state s(L);
 
-			int stack = s.get_top();
+				// the object is the first argument, the rest are the method's
+				// arguments (indexed from the top like lua_c_caller does)
 
-			s.push(OOP_CREATE_FN_NAME());
-			s.get_raw(1);
+				const int nargs = s.get_top();
 
-			if (s.is_function(-1))
+				if (nargs < 1)
+					return s.throw_error("Method called without an object");
+
+				// objects of derived classes are resolved to their ObjType
+				// part, then the cast adjusts it to the class of the method
+
+				const auto obj = s.template to_object<ObjType>(-nargs);
+
+				if (!obj)
+					return 0;
+
+				return _impl<A...>(s, *s.upvalue_userdata<M>(1), static_cast<Tx*>(obj), -nargs + 1);
+			}
+		};
+
+		/*
+		* metamethod calling a C++ operator of T, the operands are bound
+		* to the userdata so they are never copied
+		*/
+		template <typename T, operator_type O>
+		struct operator_caller
+		{
+			static constexpr const char* name()
 			{
-				for (int i = 2; i <= stack; ++i)
-					s.push_value(i);
+				switch (O)
+				{
+				case operator_type::add:		return "__add";
+				case operator_type::sub:		return "__sub";
+				case operator_type::mul:		return "__mul";
+				case operator_type::eq:			return "__eq";
+				case operator_type::lt:			return "__lt";
+				case operator_type::le:			return "__le";
+				case operator_type::unm:		return "__unm";
+				case operator_type::len:		return "__len";
+				default:						return "__tostring";
+				}
+			}
 
-				s.call_protected(stack - 1, LUA_MULTRET);
+			template <typename Fn>
+			static int binary(state& s, const Fn& fn)
+			{
+				constexpr bool with_objects = requires(const T& a) { fn(a, a); };
+				constexpr bool with_number_right = requires(const T& a, lua_Number n) { fn(a, n); };
+				constexpr bool with_number_left = requires(const T& a, lua_Number n) { fn(n, a); };
 
-				return s.get_top() - stack;
+				static_assert(with_objects || with_number_right || with_number_left, "Class doesn't have this operator");
+
+				// mixed operations with numbers if the class supports them
+
+				if constexpr (with_number_right)
+					if (s.get_type(2) == LUA_TNUMBER)
+					{
+						const auto a = s.template to_object<T>(1);
+						return a ? s.push(fn(*a, lua_tonumber(s.get(), 2))) : 0;
+					}
+
+				if constexpr (with_number_left)
+					if (s.get_type(1) == LUA_TNUMBER)
+					{
+						const auto a = s.template to_object<T>(2);
+						return a ? s.push(fn(lua_tonumber(s.get(), 1), *a)) : 0;
+					}
+
+				if constexpr (with_objects)
+				{
+					const auto a = s.template to_object<T>(1);
+					const auto b = a ? s.template to_object<T>(2) : nullptr;
+
+					return b ? s.push(fn(*a, *b)) : 0;
+				}
+				else return s.throw_error("Operator {} expects a number", name());
 			}
 
-			s.pop_n();
+			static int call(lua_State* L)
+			{
+				state s(L);
 
-			return 1;
-		}
+				if constexpr (O == operator_type::add)		return binary(s, [](const auto& a, const auto& b) -> decltype(a + b) { return a + b; });
+				else if constexpr (O == operator_type::sub)	return binary(s, [](const auto& a, const auto& b) -> decltype(a - b) { return a - b; });
+				else if constexpr (O == operator_type::mul)	return binary(s, [](const auto& a, const auto& b) -> decltype(a * b) { return a * b; });
+				else if constexpr (O == operator_type::lt)	return binary(s, [](const T& a, const T& b) -> bool { return a < b; });
+				else if constexpr (O == operator_type::le)	return binary(s, [](const T& a, const T& b) -> bool { return a <= b; });
+				else if constexpr (O == operator_type::eq)
+				{
+					// objects of other classes are never equal, the member table
+					// is compared since references have their own metatable
+
+					const auto push_members = [&](int i)
+					{
+						if (!lua_getmetatable(L, i))
+							return s.push_nil();
+
+						s.get_field(-1, "__members");
+						s.remove(-2);
+
+						return 1;
+					};
+
+					push_members(1);
+					push_members(2);
+
+					const bool same_class = !s.is_nil(-1) && lua_rawequal(L, -1, -2);
+
+					s.pop_n(2);
+
+					if (!same_class)
+					{
+						s.push_bool(false);
+						return 1;
+					}
+
+					return binary(s, [](const T& a, const T& b) -> bool { return a == b; });
+				}
+				else
+				{
+					const auto a = s.template to_object<T>(1);
 
+					if (!a)
+						return 0;
+
+					if constexpr (O == operator_type::unm)
+						return s.push(-*a);
+					else if constexpr (O == operator_type::len)
+						return s.push(std::size(*a));
+					else
+					{
+						using std::to_string;
+
+						return s.push(to_string(*a));
+					}
+				}
+			}
+		};
+
+		template <typename T, typename M, typename P>
+		struct class_method_caller { using type = M; };
+
+		template <typename T, typename Tx, typename R, typename... A, typename P>
+		struct class_method_caller<T, R(Tx::*)(A...), P> : class_method_caller_impl<P, R(Tx::*)(A...), T, Tx, R, A...> {};
+
+		template <typename T, typename Tx, typename R, typename... A, typename P>
+		struct class_method_caller<T, R(Tx::*)(A...) const, P> : class_method_caller_impl<P, R(Tx::*)(A...) const, T, const Tx, R, A...> {};
+
+		template <typename Tx, typename S, typename G>
+		struct property_access_fns : public member_access_fns
+		{
+			S s;
+			G g;
+
+			property_access_fns(S s, G g) : s(s), g(g) {}
+
+			int read(lua_State* L, void* obj) const override
+			{
+				if constexpr (std::is_null_pointer_v<G>)
+					return member_access_fns::read(L, obj);
+				else
+				{
+					state _s(L);
+
+					return _s.push((static_cast<Tx*>(obj)->*g)());
+				}
+			}
+
+			int write(lua_State* L, void* obj) const override
+			{
+				if constexpr (std::is_null_pointer_v<S>)
+					return member_access_fns::write(L, obj);
+				else
+				{
+					using type = detail::remove_cvref_t<typename detail::first_arg_member_fn<S>::type>;
+
+					state _s(L);
+
+					type value;
+
+					int i = 3;
+
+					_s._pop(value, i);
+
+					(static_cast<Tx*>(obj)->*s)(std::move(value));
+
+					return 0;
+				}
+			}
+		};
+
+		/*
+		* direct access to a data member, the value is read from and
+		* written to the object inside the userdata block
+		*/
+		template <typename Tx, typename M, bool ReadOnly>
+		struct field_access_fns : public member_access_fns
+		{
+			using value_type = std::remove_reference_t<decltype(std::declval<Tx&>().*std::declval<M>())>;
+
+			M member;
+
+			field_access_fns(M member) : member(member) {}
+
+			int read(lua_State* L, void* obj) const override
+			{
+				state _s(L);
+
+				return _s.push(static_cast<Tx*>(obj)->*member);
+			}
+
+			int write(lua_State* L, void* obj) const override
+			{
+				if constexpr (ReadOnly || std::is_const_v<value_type>)
+					return member_access_fns::write(L, obj);
+				else
+				{
+					state _s(L);
+
+					int i = 3;
+
+					_s._pop(static_cast<Tx*>(obj)->*member, i);
+
+					return 0;
+				}
+			}
+		};
+
+		template <typename T = int, typename... A>
+		static T _throw_error(lua_State* vm, const std::string& err, const A&... args) { _on_error(vm, FORMATV(err, args...)); return T{}; }
+
+		/*
+		* the member accessors of references (by_ref) get the object
+		* the userdata points to
+		*/
+		template <bool by_ref = false>
 		static int index_function(lua_State* L)
 		{
 			state s(L);
 
-			s.push_value(s.upvalue_index(1));
+			// methods and properties live in the same member table so
+			// a single raw lookup resolves the key
+
+			s.push_value(2);
+
+			if (s.get_raw(s.upvalue_index(1)) == LUA_TLIGHTUSERDATA)
+			{
+				const auto accessor = s.to_userdata<member_access_fns*>(-1);
+
+				s.pop_n();
+
+				if constexpr (by_ref)
+				{
+					const auto obj = s.ref_target(1);
+					return obj ? accessor->read(L, obj) : 0;
+				}
+				else return accessor->read(L, s.to_userdata(1));
+			}
+
+			return 1;
+		}
 
-			// first we look for a function
+		template <bool by_ref = false>
+		static int newindex_function(lua_State* L)
+		{
+			state s(L);
 
-			s.push("__class");
-			s.get_raw(-2);
+			s.push_value(2);
 
-			if (!s.is_table(-1))
+			if (s.get_raw(s.upvalue_index(1)) == LUA_TLIGHTUSERDATA)
 			{
+				const auto accessor = s.to_userdata<member_access_fns*>(-1);
+
 				s.pop_n();
+
+				if constexpr (by_ref)
+				{
+					const auto obj = s.ref_target(1);
+					return obj ? accessor->write(L, obj) : 0;
+				}
+				else return accessor->write(L, s.to_userdata(1));
+			}
+
+			s.pop_n();
+
+			return 0;
+		}
+
+		/*
+		* __index and __newindex of _G once globals are watched, keys
+		* that aren't watched go to the metamethods _G had before
+		*/
+		static int watched_index_function(lua_State* L)
+		{
+			// stack: _G, key
+
+			lua_pushvalue(L, 2);
+
+			if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL)
 				return 1;
+
+			lua_pop(L, 1);
+
+			switch (lua_type(L, lua_upvalueindex(2)))
+			{
+			case LUA_TNIL:
+				lua_pushnil(L);
+				break;
+			case LUA_TFUNCTION:
+				lua_pushvalue(L, lua_upvalueindex(2));
+				lua_pushvalue(L, 1);
+				lua_pushvalue(L, 2);
+				lua_call(L, 2, 1);
+				break;
+			default:
+				lua_pushvalue(L, 2);
+				lua_gettable(L, lua_upvalueindex(2));
 			}
 
-			s.push_value(2);
-			s.get_raw(-2);
-			s.remove(-2);
+			return 1;
+		}
+
+		static int watched_newindex_function(lua_State* L)
+		{
+			// stack: _G, key, value
+
+			lua_pushvalue(L, 2);
 
-			if (s.is_function(-1))
+			const bool watched = lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL;
+
+			lua_pop(L, 1);
+
+			if (watched)
 			{
-				// found the function, clean up and return
+				lua_rawset(L, lua_upvalueindex(2));
+
+				++state(L).get_info()->globals_version;
+
+				return 0;
+			}
+
+			switch (lua_type(L, lua_upvalueindex(3)))
+			{
+			case LUA_TNIL:
+				lua_rawset(L, 1);
+				break;
+			case LUA_TFUNCTION:
+				lua_pushvalue(L, lua_upvalueindex(3));
+				lua_insert(L, 1);
+				lua_call(L, 3, 0);
+				break;
+			default:
+				lua_settable(L, lua_upvalueindex(3));
+			}
+
+			return 0;
+		}
+
+		template <typename T>
+		static int array_view_index(lua_State* L)
+		{
+			state s(L);
+
+			const auto view = s.to_array_view<array_view<T>>(1);
+
+			if (!view)
+				return 0;
+
+			int isnum = 0;
+
+			const auto i = lua_tointegerx(L, 2, &isnum);
+
+			if (isnum && i >= 1 && static_cast<lua_Unsigned>(i) <= view->size())
+				return s.push_element(*view, static_cast<size_t>(i - 1));
+
+			return s.push_nil();
+		}
+
+		template <typename T>
+		static int array_view_newindex(lua_State* L)
+		{
+			state s(L);
+
+			const auto view = s.to_array_view<array_view<T>>(1);
+
+			if (!view)
+				return 0;
+
+			if (view->is_read_only())
+				return s.throw_error("Array view is read-only");
+
+			int isnum = 0;
+
+			const auto i = lua_tointegerx(L, 2, &isnum);
+
+			if (!isnum || i < 1 || static_cast<lua_Unsigned>(i) > view->size())
+				return s.throw_error("Array view index out of bounds");
+
+			int value_index = 3;
+
+			s._pop(view->data()[i - 1], value_index);
+
+			return 0;
+		}
+
+		template <typename T>
+		static int array_view_len(lua_State* L)
+		{
+			state s(L);
+
+			const auto view = s.to_array_view<array_view<T>>(1);
+
+			if (!view)
+				return 0;
+
+			s.push_int(static_cast<lua_Integer>(view->size()));
+
+			return 1;
+		}
+
+		template <typename T>
+		static int array_view_next(lua_State* L)
+		{
+			state s(L);
+
+			const auto view = s.to_array_view<array_view<T>>(1);
+
+			if (!view)
+				return 0;
+
+			const auto i = lua_tointeger(L, 2) + 1;
+
+			if (static_cast<lua_Unsigned>(i) > view->size())
+				return s.push_nil();
+
+			s.push_int(i);
 
-				s.remove(-2);
+			return 1 + s.push_element(*view, static_cast<size_t>(i - 1));
+		}
 
-				return 1;
-			}
+		/*
+		* objects of registered classes are pushed as references so they
+		* can be modified in place, unless the view is read-only
+		*/
+		template <typename T>
+		int push_element(const array_view<T>& view, size_t i) const
+		{
+			if constexpr (detail::is_object<T>)
+				if (!view.is_read_only())
+					if (const auto class_info = get_info()->template get_class<T>())
+					{
+						new (new_userdata<element_ref<T>>()) element_ref<T>(view, i);
+						push_ref_metatable(class_info);
+						set_metatable(-2);
 
-			s.pop_n();
+						return 1;
+					}
 
-			// function not found, look for property
+			return push(view.data()[i]);
+		}
 
-			s.push("__get");
-			s.get_raw(-2);
+		/*
+		* copy of the class' metatable without __gc, the member accessors
+		* get the object the reference points to
+		*/
+		void push_ref_metatable(state_info::oop_class* class_info) const
+		{
+			if (class_info->ref_mt != LUA_NOREF)
+				return get_class(class_info->ref_mt);
 
-			if (!s.is_table(-1))
-			{
-				s.pop_n();
-				return 1;
-			}
-			
-			s.push_value(2);
-			s.get_raw(-2);
-			s.remove(-2);
+			push_table();
+			get_class(class_info->ref);
+			push_nil();
 
-			if (s.is_function(-1))
+			while (next(-2))
 			{
-				// found the property
+				if (get_type(-2) != LUA_TSTRING || to_string_view(-2).first != "__gc")
+				{
+					push_value(-2);
+					push_value(-2);
+					set_raw(-6);
+				}
 
-				s.remove(-2);
+				pop_n();
+			}
 
-				s.push_value(1);	// push field
-				s.push_value(2);	// push userdata
-				s.call_protected(2, 1);
+			push("__index");	push("__members"); get_raw(-4); push_c_closure(index_function<true>); set_raw(-4);
+			push("__newindex");	push("__members"); get_raw(-4); push_c_closure(newindex_function<true>); set_raw(-4);
+			pop_n();
 
-				return 1;
-			}
+			// to_object finds the class with no offset and the mark of
+			// the references
 
-			s.pop_n();
+			push_int(0);
+			set_raw_p(-2, class_info);
+			push_bool(true);
+			set_raw_p(-2, TYPEINFO(object_ref));
 
-			return 1;
+			push_value(-1);
+			class_info->ref_mt = ref();
 		}
 
-		static int newindex_function(lua_State* L)
+		template <typename T>
+		static int array_view_pairs(lua_State* L)
 		{
 			state s(L);
 
-			s.push_value(s.upvalue_index(1));
+			s.push_c_fn(array_view_next<T>);
+			s.push_value(1);
+			s.push_int(0);
 
-			s.push("__set");
-			s.get_raw(-2);
+			return 3;
+		}
 
-			if (!s.is_table(-1))
-			{
-				s.pop_n();
-				return 0;
-			}
+		/*
+		* pushes the metatable shared by all the views of T, it's
+		* created the first time and kept in the registry
+		*/
+		template <typename T>
+		void push_array_view_metatable() const
+		{
+			if (get_raw_p(LUA_REGISTRYINDEX, TYPEINFO(array_view<T>)) != LUA_TNIL)
+				return;
 
-			s.push_value(2);
-			s.get_raw(-2);
-			s.remove(-2);
+			pop_n();
+
+			push_table(0, 4);
+			push_c_fn(array_view_index<T>);		set_field(-2, "__index");
+			push_c_fn(array_view_newindex<T>);	set_field(-2, "__newindex");
+			push_c_fn(array_view_len<T>);		set_field(-2, "__len");
+			push_c_fn(array_view_pairs<T>);		set_field(-2, "__pairs");
+
+			push_value(-1);
+			set_raw_p(LUA_REGISTRYINDEX, TYPEINFO(array_view<T>));
+		}
 
-			if (s.is_function(-1))
+		/*
+		* pushes the table holding the member names of a reflected
+		* struct, the strings are interned once and reused as keys
+		* so fields are set without hashing their names again
+		*/
+		template <typename T>
+		int push_reflected_keys() const
+		{
+			if (get_raw_p(LUA_REGISTRYINDEX, TYPEINFO(reflect<T>)) == LUA_TNIL)
 			{
-				// found the property
+				pop_n();
 
-				s.push_value(3);	// push new value
-				s.push_value(1);	// push userdata
-				s.push_value(2);	// push field
+				push_table(static_cast<int>(std::tuple_size_v<decltype(reflect<T>::members)>), 0);
 
-				s.call_protected(3, 0);
+				std::apply([&](const auto&... m)
+				{
+					lua_Integer n = 1;
 
-				s.pop_n();
+					((push_string(m.name), set_raw(-2, n++)), ...);
+				}, reflect<T>::members);
 
-				return 0;
+				push_value(-1);
+				set_raw_p(LUA_REGISTRYINDEX, TYPEINFO(reflect<T>));
 			}
 
-			s.pop_n();
-
-			return 0;
+			return get_top();
 		}
 
 		template <typename T = int, typename... A>
@@ -672,49 +1749,38 @@ namespace luas
 				throw_error("Function {} undefined", fn);
 		}
 
-		template <typename Key, typename Value, typename Fn>
-		bool iterate_table(const Fn& fn, int i) const
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(const T& value) const requires(std::is_same_v<DT, variadic_args>);
+
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(detail::is_vector<DT> || detail::is_set<DT>)
 		{
-			if (!is_table(i))
-				return true;
+			if (!check_stack(2))
+				return throw_error("Stack overflow pushing a table");
 
-			const auto _fail = [this]() { pop_n(2); return false; };
+			// the size is known so the table is created with the exact
+			// array size and filled with raw sets
 
-			push_nil();
+			push_table(static_cast<int>(value.size()), 0);
 
-			while (next(i - 1))
+			for (lua_Integer i = 1; const auto & v : value)
 			{
-				const auto [k, k_ok] = value_from_type<Key>(-2);
-
-				if (!k_ok)
-					return _fail();
+				if (!push(v))
+					push_nil();
 
-				const auto [v, v_ok] = value_from_type<Value>(-1);
-
-				if (!v_ok)
-					return _fail();
-
-				fn(k, v);
-
-				pop_n();
+				set_raw(-2, i++);
 			}
 
-			return true;
+			return 1;
 		}
 
 		template <typename T, typename DT = detail::remove_cvref_t<T>>
-		int _push(const T& value) const requires(std::is_same_v<DT, variadic_args>);
-
-		template <typename T, typename DT = detail::remove_cvref_t<T>>
-		int _push(T&& value) const requires(detail::is_vector<DT> || detail::is_set<DT>)
+		int _push(T&& value) const requires(detail::is_array_view<DT>)
 		{
-			push_table();
+			new (new_userdata<DT>()) DT(value);
 
-			for (int i = 1; const auto & v : value)
-			{
-				push(i++, v);
-				set_table(-3);
-			}
+			push_array_view_metatable<typename DT::value_type>();
+			set_metatable(-2);
 
 			return 1;
 		}
@@ -732,20 +1798,101 @@ namespace luas
 			return c;
 		}
 
-		template <typename T>
-		int _push(T&& value) const requires(detail::is_map<T>)
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(detail::is_map<DT>)
 		{
-			push_table();
+			if (!check_stack(3))
+				return throw_error("Stack overflow pushing a table");
+
+			push_table(0, static_cast<int>(value.size()));
+
+			const int table = get_top();
 
 			for (const auto& [k, v] : value)
 			{
-				push(k, v);
-				set_table(-3);
+				// skip the pair if the key or value can't be pushed
+
+				if (push(k, v) == 2)
+					set_raw(table);
+				else pop_n(get_top() - table);
+			}
+
+			return 1;
+		}
+
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(detail::is_reflected<DT>)
+		{
+			if (!check_stack(4))
+				return throw_error("Stack overflow pushing a table");
+
+			constexpr auto& members = reflect<DT>::members;
+
+			const int keys = push_reflected_keys<DT>();
+
+			push_table(0, static_cast<int>(std::tuple_size_v<detail::remove_cvref_t<decltype(members)>>));
+
+			std::apply([&](const auto&... m)
+			{
+				lua_Integer n = 1;
+
+				([&]
+				{
+					get_raw(keys, n++);
+
+					if (push(value.*(m.ptr)))
+						set_raw(keys + 1);
+					else pop_n();
+				}(), ...);
+			}, members);
+
+			remove(keys);
+
+			return 1;
+		}
+
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(detail::is_optional<DT>)
+		{
+			return value ? push(*value) : push_nil();
+		}
+
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(detail::is_variant<DT>)
+		{
+			return std::visit([&](const auto& v) { return push(v); }, value);
+		}
+
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(std::is_same_v<DT, std::monostate>) { return push_nil(); }
+
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(detail::is_value<DT>)
+		{
+			switch (value.t)
+			{
+			case luas::value::type::boolean:	push_bool(value.b); break;
+			case luas::value::type::integer:	push_int(value.i); break;
+			case luas::value::type::number:	push_number(value.n); break;
+			case luas::value::type::string:	push_string(value.as_string()); break;
+			case luas::value::type::userdata:	push_userdata(value.p); break;
+			case luas::value::type::ref:		get_raw(LUA_REGISTRYINDEX, value.ref.id); break;
+			default:					push_nil();
 			}
 
 			return 1;
 		}
 
+		/*
+		* tuples and pairs are pushed as multiple values, the same
+		* way functions return them
+		*/
+		template <typename T, typename DT = detail::remove_cvref_t<T>>
+		int _push(T&& value) const requires(detail::is_tuple<DT> || detail::is_pair<DT>)
+		{
+			return std::apply([&](const auto&... v) { return push(v...); }, value);
+		}
+
 		template <typename T, typename DT = detail::remove_cvref_t<T>>
 		int _push(T&& value) const requires(detail::is_bool<DT>) { push_bool(value); return 1; }
 
@@ -756,7 +1903,16 @@ namespace luas
 		int _push(T&& value) const requires(std::is_floating_point_v<DT>) { push_number(value); return 1; }
 
 		template <typename T, typename DT = std::remove_cvref_t<T>>
-		int _push(T&& value) const requires(detail::is_string<DT>) { push_string(std::forward<T>(value)); return 1; }
+		int _push(T&& value) const requires(detail::is_string<DT>)
+		{
+			// char arrays may be buffers bigger than the string they hold
+
+			if constexpr (detail::is_string_array<DT>)
+				push_string(std::string_view(value, std::find(value, value + std::extent_v<DT>, '\0')));
+			else push_string(value);
+
+			return 1;
+		}
 
 		template <typename T, typename DT = std::remove_cvref_t<T>>
 		int _push(T&& value) const
@@ -764,26 +1920,19 @@ namespace luas
 			if constexpr (detail::is_userdata<DT>)
 				return push_userdata(value);
 			else if constexpr (!std::is_abstract_v<DT>)
-				if (const auto state_info = get_info())
-					if (const auto class_info = state_info->get_class(TYPEINFO(DT)))
-					{
-						//static_assert(std::is_constructible_v<DT>, "Return type must have default constructor");
-
-						// create the default object
-
-						const auto ptr = new (new_userdata<DT>()) DT();
-
-						// move the value to the new memory
+				if (const auto class_info = get_info()->template get_class<DT>())
+				{
+					// construct the object straight into the userdata
 
-						*ptr = std::move(value);
+					new (new_userdata<DT>()) DT(std::forward<T>(value));
 
-						// set class' metatable
+					// set class' metatable
 
-						get_class(class_info->name);
-						set_metatable(-2);
+					get_class(class_info->ref);
+					set_metatable(-2);
 
-						return 1;
-					}
+					return 1;
+				}
 
 			return 0;
 		}
@@ -797,28 +1946,262 @@ namespace luas
 		template <typename T>
 		void _pop(T& value, int& i) const requires(std::is_floating_point_v<T>) { value = static_cast<T>(to_number(i++).first); }
 
-		template <typename T>
-		void _pop(T& value, int& i) const requires(detail::is_string<T>) { value = T(to_string(i++).first); }
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_string<T> && !detail::is_string_array<T>)
+		{
+			// views and pointers point to the string owned by lua, only
+			// arguments can be read like this since they stay on the stack
+			// for the whole call (see pop)
+
+			if constexpr (detail::is_string_ptr<T>)
+				value = to_string_view(i++).first.data();
+			else value = T(to_string_view(i++).first);
+		}
+
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_userdata<T>)
+		{
+			// objects are upcast when T points to a base of their class
+
+			if constexpr (detail::is_object<std::remove_cv_t<std::remove_pointer_t<T>>>)
+				if (get_type(i) == LUA_TUSERDATA)
+				{
+					value = to_object<std::remove_cv_t<std::remove_pointer_t<T>>>(i++);
+					return;
+				}
+
+			value = to_userdata<T>(i++);
+		}
+
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_vector<T> || detail::is_set<T>)
+		{
+			const int table = abs_index(i++);
+
+			if (!is_table(table))
+			{
+				throw_error("Expected 'table' value, got '{}'", LUA_GET_TYPENAME(table));
+				return;
+			}
+
+			if (!check_stack(2))
+			{
+				throw_error("Stack overflow reading a table");
+				return;
+			}
+
+			// read the array part in order with raw gets, nested tables
+			// are read straight into the elements
+
+			const auto size = static_cast<size_t>(raw_len(table));
+
+			if constexpr (detail::is_vector<T>)
+				value.resize(size);
+			else
+			{
+				value.clear();
+
+				if constexpr (requires { value.reserve(size); })
+					value.reserve(size);
+			}
+
+			for (size_t n = 0; n < size; ++n)
+			{
+				get_raw(table, static_cast<lua_Integer>(n + 1));
+
+				int element = -1;
+
+				if constexpr (detail::is_vector<T> && !std::is_same_v<typename T::value_type, bool>)
+					_pop(value[n], element);
+				else
+				{
+					typename T::value_type v {};
+
+					_pop(v, element);
+
+					if constexpr (detail::is_vector<T>)
+						value[n] = v;
+					else value.insert(std::move(v));
+				}
+
+				pop_n();
+			}
+		}
+
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_map<T>)
+		{
+			using key_type = typename T::key_type;
+
+			const int table = abs_index(i++);
+
+			if (!is_table(table))
+			{
+				throw_error("Expected 'table' value, got '{}'", LUA_GET_TYPENAME(table));
+				return;
+			}
+
+			if (!check_stack(3))
+			{
+				throw_error("Stack overflow reading a table");
+				return;
+			}
+
+			value.clear();
+
+			// the array part is the only size lua exposes, good enough
+			// for maps with integer keys
+
+			if constexpr (requires { value.reserve(size_t {}); })
+				value.reserve(static_cast<size_t>(raw_len(table)));
+
+			push_nil();
+
+			while (next(table))
+			{
+				// keys of another type are skipped, converting a non-string
+				// key to a string would also change the key in place and
+				// break the traversal
+
+				if (!(get_type_bits(-2) & detail::type_mask<key_type>()))
+				{
+					pop_n();
+					continue;
+				}
+
+				key_type k {};
+
+				int key = -2;
+
+				_pop(k, key);
+
+				// the value is read in place so nested tables aren't
+				// copied once they are converted
+
+				int element = -1;
+
+				_pop(value[std::move(k)], element);
+
+				pop_n();
+			}
+		}
+
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_reflected<T>)
+		{
+			const int table = abs_index(i++);
+
+			if (!is_table(table))
+			{
+				throw_error("Expected 'table' value, got '{}'", LUA_GET_TYPENAME(table));
+				return;
+			}
+
+			if (!check_stack(3))
+			{
+				throw_error("Stack overflow reading a table");
+				return;
+			}
+
+			const int keys = push_reflected_keys<T>();
+
+			// missing fields keep their value
+
+			std::apply([&](const auto&... m)
+			{
+				lua_Integer n = 1;
+
+				([&]
+				{
+					get_raw(keys, n++);
+
+					if (get_raw(table) != LUA_TNIL)
+					{
+						int field = -1;
+
+						_pop(value.*(m.ptr), field);
+					}
+
+					pop_n();
+				}(), ...);
+			}, reflect<T>::members);
+
+			pop_n();
+		}
+
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_optional<T>)
+		{
+			if (get_type(i) <= LUA_TNIL)
+			{
+				value.reset();
+				++i;
+			}
+			else _pop(value.emplace(), i);
+		}
+
+		/*
+		* the alternative is picked by the lua type of the value, the
+		* first alternative accepting it is used
+		*/
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_variant<T>)
+		{
+			const auto type = get_type_bits(i);
+
+			const bool found = [&]<size_t... I>(std::index_sequence<I...>)
+			{
+				return ((detail::type_mask<std::variant_alternative_t<I, T>>() & type ? (_pop(value.template emplace<I>(), i), true) : false) || ...);
+			}(std::make_index_sequence<std::variant_size_v<T>>());
+
+			if (!found)
+				throw_error("No variant alternative accepts '{}'", LUA_GET_TYPENAME(i++));
+		}
 
 		template <typename T>
-		void _pop(T& value, int& i) const requires(detail::is_userdata<T>) { value = to_userdata<T>(i++); }
+		void _pop(T& value, int& i) const requires(std::is_same_v<T, std::monostate>) { ++i; }
 
 		template <typename T>
-		void _pop(T& value, int& i) const requires(detail::is_vector<T> || detail::is_set<T>)
+		void _pop(T& value, int& i) const requires(detail::is_value<T>)
 		{
-			int table_index = 0;
+			const auto index = i++;
+
+			value.reset();
+
+			switch (get_type(index))
+			{
+			case LUA_TNONE:
+			case LUA_TNIL:				break;
+			case LUA_TBOOLEAN:			value = !!lua_toboolean(_state, index); break;
+			case LUA_TLIGHTUSERDATA:	value = lua_touserdata(_state, index); break;
+			case LUA_TNUMBER:
+			{
+				if (lua_isinteger(_state, index))
+					value = lua_tointeger(_state, index);
+				else value = lua_tonumber(_state, index);
 
-			value.resize(raw_len(i));
+				break;
+			}
+			case LUA_TSTRING:			value.set_string(to_string_view(index).first); break;
+			default:
+			{
+				push_value(index);
+				value.set_ref(_state);
+			}
+			}
+		}
 
-			iterate_table<int, typename T::value_type>([&](const auto&, const auto& v)
-			{ value[table_index++] = v; }, i);
+		template <typename T>
+		void _pop(T& value, int& i) const requires(detail::is_tuple<T> || detail::is_pair<T>)
+		{
+			std::apply([&](auto&... v) { (_pop(v, i), ...); }, value);
 		}
 
 		template <typename T>
-		void _pop(T& value, int& i) const requires(detail::is_map<T>)
+		void _pop(T& value, int& i) const requires(detail::is_array_view<T>)
 		{
-			iterate_table<typename T::key_type, typename T::mapped_type>([&](const auto& k, const auto& v)
-			{ value[k] = v; }, i);
+			if (const auto view = to_array_view<T>(i++))
+				value = *view;
 		}
 
 		template <typename T>
@@ -834,14 +2217,8 @@ namespace luas
 		template <typename T>
 		void _pop(T& value, int& i) const
 		{
-			if (const auto state_info = get_info())
-				if (const auto class_info = state_info->get_class(TYPEINFO(T)))
-				{
-					value = *to_userdata<T*>(i++);
-
-					get_class(class_info->name);
-					set_metatable(-2);
-				}
+			if (const auto obj = to_object<T>(i++))
+				value = *obj;
 		}
 
 		void get_global(const std::string& name) const { lua_getglobal(_state, name.c_str()); }
@@ -858,25 +2235,25 @@ namespace luas
 
 		void init_oop()
 		{
+			if (get_field(LUA_REGISTRYINDEX, "mt") != LUA_TNIL)
+				return pop_n();
+
+			pop_n();
 			push_table();
 			set_field(LUA_REGISTRYINDEX, "mt");
-			get_field(LUA_REGISTRYINDEX, "mt");
-			push_table();
-			push_c_fn(oop_obj_create);
-			set_field(-2, "__call");
-			set_field(-2, "Generic");
-			pop_n();
 		}
 
-		void begin_class()
+		void begin_class(lua_CFunction ctor)
 		{
 			push_table();
 
-			push("__class");	push_table();	get_class("Generic"); set_metatable(-2); set_raw(-3);
-			push("__get");		push_table();	set_raw(-3);
-			push("__set");		push_table();	set_raw(-3);
-			push("__index");	push_value(-2); push_c_closure(index_function); set_raw(-3);
-			push("__newindex");	push_value(-2); push_c_closure(newindex_function); set_raw(-3);
+			// calling the class table constructs an object, the closure
+			// holds the metatable of the objects
+
+			push("__class");	push_table();	push_table(0, 1); push_value(-4); push_c_closure(ctor, 1); set_field(-2, "__call"); set_metatable(-2); set_raw(-3);
+			push("__members");	push_table();	set_raw(-3);
+			push("__index");	push("__members"); get_raw(-3); push_c_closure(index_function<>); set_raw(-3);
+			push("__newindex");	push("__members"); get_raw(-3); push_c_closure(newindex_function<>); set_raw(-3);
 		}
 
 		void add_class_metamethod(const std::string& method_name, lua_CFunction fn)
@@ -905,60 +2282,145 @@ namespace luas
 			}
 		}
 
-		void add_class_variable(const std::string& variable_name, lua_CFunction set, lua_CFunction get)
+		template <typename M>
+		void add_class_method(const std::string& fn_name, lua_CFunction fn, const M& method)
 		{
-			push("__set");
+			// methods go to the class table and the member table
+			// used by __index
+
+			push("__class");
 			get_raw(-2);
+			push("__members");
+			get_raw(-3);
 
-			if (!set)
-			{
-				push(variable_name);
-				push(variable_name);
-				push_c_closure(read_only);
-				set_raw(-3);
-			}
-			else
-			{
-				push(variable_name);
-				push(variable_name);
-				push_c_closure(set);
-				set_raw(-3);
-			}
+			push(fn_name);
+			new (new_userdata<M>()) M(method);
+			push_c_closure(fn, 1);
+			push_value(-2);
+			push_value(-2);
+			set_raw(-5);
+			set_raw(-4);
+			pop_n(2);
+		}
 
+		void add_class_member(const std::string& member_name, member_access_fns* accessor)
+		{
+			push("__members");
+			get_raw(-2);
+
+			push(member_name);
+			push_userdata(accessor);
+			set_raw(-3);
 			pop_n();
+		}
 
-			push("__get");
-			get_raw(-2);
+		/*
+		* copies the methods and properties of a base to the class being
+		* defined (on top of the stack) so they are found without walking
+		* the bases. the offset of every base is stored in the metatable
+		* keyed by its class info to upcast objects
+		*/
+		template <typename T, typename B>
+		void inherit_class(state_info::oop_class* class_info)
+		{
+			const auto base_info = get_info()->template get_class<B>();
+
+			check_fatal(base_info, "Base class must be registered before the class");
+
+			const auto offset = detail::base_offset<T, B>();
+
+			const int mt = get_top();
 
-			if (!get)
+			get_class(base_info->ref);
+
+			const int base_mt = get_top();
+
+			// the base and the bases of the base
+
+			push_int(offset);
+			set_raw_p(mt, base_info);
+
+			push_nil();
+
+			while (next(base_mt))
 			{
-				push(variable_name);
-				push(variable_name);
-				push_c_closure(write_only);
-				set_raw(-3);
+				if (get_type(-2) == LUA_TLIGHTUSERDATA)
+				{
+					push_value(-2);
+					push_int(lua_tointeger(_state, -2) + offset);
+					set_raw(mt);
+				}
+
+				pop_n();
 			}
-			else
+
+			push("__members");	get_raw(base_mt);
+			push("__members");	get_raw(mt);
+			push("__class");	get_raw(mt);
+
+			const int base_members = base_mt + 1,
+					  members = base_mt + 2,
+					  class_table = base_mt + 3;
+
+			push_nil();
+
+			while (next(base_members))
 			{
-				push(variable_name);
-				push(variable_name);
-				push_c_closure(get);
-				set_raw(-3);
+				// members of the class itself (or of a previous base) are
+				// never replaced, no matter the order of the arguments
+
+				push_value(-2);
+
+				const bool overridden = get_raw(members) != LUA_TNIL;
+
+				pop_n();
+
+				if (!overridden && get_type(-1) == LUA_TLIGHTUSERDATA)
+				{
+					auto accessor = static_cast<member_access_fns*>(to_userdata(-1));
+
+					if (offset != 0)
+						accessor = class_info->template add_member<offset_access_fns>(accessor, offset);
+
+					push_value(-2);
+					push_userdata(accessor);
+					set_raw(members);
+				}
+				else if (!overridden && is_function(-1))
+				{
+					// methods resolve the base part of the object themselves
+					// so the closure is shared
+
+					push_value(-2);
+					push_value(-2);
+					set_raw(class_table);
+
+					push_value(-2);
+					push_value(-2);
+					set_raw(members);
+				}
+
+				pop_n();
 			}
 
-			pop_n();
+			pop_n(4);
 		}
 
-		void end_class(const std::string& class_name)
+		void end_class(const std::string& class_name, state_info::oop_class* class_info)
 		{
 			push("mt");
 			get_raw(LUA_REGISTRYINDEX);
 
-			// store in registry
+			// store in registry by name and keep a reference so pushing
+			// objects doesn't have to look it up
 
 			push_value(-2);
 			set_field(-2, class_name.c_str());
 			pop_n();
 
+			push_value(-1);
+			class_info->ref = ref();
+
 			get_field(-1, "__class");
 			set_global(class_name.c_str());
 			pop_n();
@@ -968,35 +2430,52 @@ namespace luas
 
 		state() {}
 		state(lua_State* _state) : _state(_state) {}									// mostly for views
-		state(lua_State* _state, bool oop) : _state(_state) { if (oop) init_oop(); }	// used by luas::ctx
+		state(lua_State* _state, bool oop) : _state(_state) { init_info(); if (oop) init_oop(); }	// used by luas::ctx and to attach other states
 		~state() { make_invalid(); }
 
 		template <typename T, typename Ctor, typename... A>
 		bool register_class(const std::string& name, A&&... args)
 		{
-			static const auto type_info = TYPEINFO(T);
-
 			auto create = [](lua_State* L)
 			{
 				state s(L);
 
-				if (const auto class_info = s.get_info()->get_class(type_info))
+				if (const auto class_info = s.get_info()->template get_class<T>())
 				{
-					ctor_caller<T>::call<Ctor>(s);
-
-					s.get_class(class_info->name);
-					s.set_metatable(-2);
+					if (ctor_caller<T>::template call<Ctor>(s, 1))
+					{
+						s.get_class(class_info->ref);
+						s.set_metatable(-2);
+					}
+					else s.push_nil();
 				}
 				else s.push_nil();
 
 				return 1;
 			};
 
-			auto destroy = [](lua_State* L)
+			auto construct = [](lua_State* L)
+			{
+				state s(L);
+
+				// the class table is the first argument
+
+				if (!ctor_caller<T>::template call<Ctor>(s, 2))
+					return s.push_nil();
+
+				s.push_value(s.upvalue_index(1));
+				s.set_metatable(-2);
+
+				return 1;
+			};
+
+			[[maybe_unused]] auto destroy = [](lua_State* L)
 			{
 				state s(L);
 
-				T* obj; s.pop(obj, -1);
+				// __gc only runs on objects of this class
+
+				const auto obj = s.to_userdata<T*>(1);
 
 				if (obj)
 				{
@@ -1012,14 +2491,12 @@ namespace luas
 				return 1;
 			};
 
-			// create state info if it doesn't exist
-
 			const auto state_info = get_info();
 
-			if (state_info->has_class(type_info))
+			if (state_info->template has_class<T>())
 				return false;
 
-			const auto class_info = state_info->add_class(type_info);
+			const auto class_info = state_info->template add_class<T>();
 
 			class_info->name = name;
 
@@ -1033,60 +2510,77 @@ namespace luas
 
 				if constexpr (std::derived_from<Ix, property_wrapper_base>)
 				{
-					s->add_class_variable(v.key, [](lua_State* L)
-					{
-						// setter
+					using accessor_type = property_access_fns<T, decltype(Ix::s), decltype(Ix::g)>;
 
-						state s(L);
+					s->add_class_member(v.key, state_info->template get_class<T>()->template add_member<accessor_type>(v.s, v.g));
+				}
+				else if constexpr (std::derived_from<Ix, field_wrapper_base>)
+				{
+					using accessor_type = field_access_fns<T, decltype(Ix::value), Ix::read_only>;
+
+					s->add_class_member(v.key, state_info->template get_class<T>()->template add_member<accessor_type>(v.value));
+				}
+				else if constexpr (std::derived_from<Ix, function_wrapper_base>)
+				{
+					s->add_class_method(v.key, class_method_caller<T, decltype(Ix::value), typename Ix::policy>::call, v.value);
+				}
+				else if constexpr (std::derived_from<Ix, base_wrapper_base>)
+				{
+					s->template inherit_class<T, typename Ix::type>(state_info->template get_class<T>());
+				}
+				else if constexpr (std::is_same_v<Ix, deferred_destroy_t>)
+				{
+					// handled when the class is defined
+				}
+				else if constexpr (std::derived_from<Ix, operator_wrapper_base>)
+				{
+					using caller_type = operator_caller<T, Ix::type>;
 
-						std::string field; s.pop(field);
+					s->add_class_metamethod(caller_type::name(), caller_type::call);
+				}
 
-						if (const auto field_info = s.get_info()->get_class(type_info)->get_field_info(field))
-							return class_fn_caller<detail::keep_member_ptr_fn_v<decltype(Ix::s)>>::call(s, field_info->write);
+				if constexpr (sizeof...(IA) > 0)
+					self(self, s, std::forward<IA>(args)...);
+			};
 
-						return s.push_nil();
-					}, [](lua_State* L)
-					{
-						// getter
+			// objects that don't need a destructor are left without a
+			// finalizer so the collector frees them in a single cycle
 
-						state s(L);
+			constexpr bool deferred = (std::is_same_v<std::remove_cvref_t<A>, deferred_destroy_t> || ...);
 
-						std::string field; s.pop(field);
+			begin_class(construct);
+			add_class_function("create", create);
 
-						if (const auto field_info = s.get_info()->get_class(type_info)->get_field_info(field))
-							return class_fn_caller<detail::keep_member_ptr_fn_v<decltype(Ix::g)>>::call(s, field_info->read);
+			if constexpr (deferred && !std::is_trivially_destructible_v<T>)
+			{
+				static_assert(std::is_move_constructible_v<T>, "Deferred destruction needs a move constructor");
 
-						return s.push_nil();
-					});
+				class_info->deferred = std::make_unique<deferred_objects<T>>();
 
-					state_info->get_class(type_info)->add_field(v.key, v.s, v.g);
-				}
-				else if constexpr (std::derived_from<Ix, function_wrapper_base>)
+				add_class_metamethod("__gc", [](lua_State* L)
 				{
-					s->add_class_function(v.key, [](lua_State* L)	// method
-					{
-						state s(L);
+					state s(L);
 
-						if (const auto fn = s.get_info()->get_class(type_info)->get_function(TYPEINFO(Ix::value)))
-							return class_fn_caller<detail::keep_member_ptr_fn_v<decltype(Ix::value)>>::call(s, fn);
+					// move the object out, only the moved-from object
+					// is destroyed now
 
-						return s.push_nil();
-					});
+					const auto obj = s.to_userdata<T*>(1);
+					const auto pending = static_cast<deferred_objects<T>*>(s.get_info()->template get_class<T>()->deferred.get());
 
-					state_info->get_class(type_info)->add_function(TYPEINFO(Ix::value), v.value);
-				}
+					pending->objects.push_back(std::move(*obj));
 
-				if constexpr (sizeof...(IA) > 0)
-					self(self, s, std::forward<IA>(args)...);
-			};
+					obj->~T();
 
-			begin_class();
-			add_class_function("create", create);
-			add_class_metamethod("__gc", destroy);
+					return 0;
+				});
+			}
+			else if constexpr (!std::is_trivially_destructible_v<T>)
+				add_class_metamethod("__gc", destroy);
 
-			iterate_args(iterate_args, this, std::forward<A>(args)...);
+			if constexpr (sizeof...(A) > 0)
+				iterate_args(iterate_args, this, std::forward<A>(args)...);
 
-			end_class(name);
+			end_class(name, class_info);
 
 			return true;
 		}
@@ -1094,7 +2588,51 @@ namespace luas
 		lua_State* get() const { return _state; }
 		lua_State* operator * () const { return get(); }
 
-		state_info* get_info() const { return &states_info[_state]; }
+		/*
+		* the state info pointer lives in the extra space of the main
+		* thread, lua copies it to every thread (coroutine) created from
+		* it so all of them share the same info. states that weren't
+		* created by luas::ctx must be attached with state(L, oop) before
+		* using classes and creating threads
+		*/
+		state_info* get_info() const { return *static_cast<state_info**>(lua_getextraspace(_state)); }
+
+		/*
+		* the info itself is a userdata in the registry, attaching the
+		* same state again reuses it and lua_close destroys it
+		*/
+		void init_info() const
+		{
+			state_info* info = nullptr;
+
+			if (get_raw_p(LUA_REGISTRYINDEX, TYPEINFO(state_info)) == LUA_TNIL)
+			{
+				pop_n();
+
+				info = new (new_userdata<state_info>()) state_info();
+
+				push_table(0, 1);
+				push_c_fn([](lua_State* L) { static_cast<state_info*>(lua_touserdata(L, 1))->~state_info(); return 0; });
+				set_field(-2, "__gc");
+				set_metatable(-2);
+				set_raw_p(LUA_REGISTRYINDEX, TYPEINFO(state_info));
+			}
+			else
+			{
+				info = static_cast<state_info*>(lua_touserdata(_state, -1));
+
+				pop_n();
+			}
+
+			get_raw(LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+
+			const auto main_thread = lua_tothread(_state, -1);
+
+			pop_n();
+
+			*static_cast<state_info**>(lua_getextraspace(main_thread)) = info;
+			*static_cast<state_info**>(lua_getextraspace(_state)) = info;
+		}
 
 		operator bool() const { return !!_state; }
 
@@ -1114,11 +2652,8 @@ namespace luas
 		{
 			check_fatal(_state, "Invalid state");
 
-			// remove the state entry from the class member access map
-
-			states_info.erase(_state);
-
-			// close lua state
+			// close lua state, the state info is created before any object
+			// of a registered class so its finalizer runs after theirs
 
 			lua_close(_state);
 		}
@@ -1133,13 +2668,18 @@ namespace luas
 		void push_bool(bool v) const { lua_pushboolean(_state, v); }
 		void push_int(lua_Integer v) const { lua_pushinteger(_state, v); }
 		void push_number(lua_Number v) const { lua_pushnumber(_state, v); }
-		void push_string(const std::string& v) const { lua_pushstring(_state, v.c_str()); }
-		void push_table() const { lua_newtable(_state); }
+		void push_string(std::string_view v) const { lua_pushlstring(_state, v.data(), v.size()); }
+		void push_string(const char* v) const { lua_pushstring(_state, v); }
+		void push_table(int narr = 0, int nrec = 0) const { lua_createtable(_state, narr, nrec); }
 		void set_metatable(int i) const { lua_setmetatable(_state, i); }
 		void set_raw(int i) const { lua_rawset(_state, i); }
-		void set_field(int i, const char* k) { lua_setfield(_state, i, k); }
-		void push_c_fn(lua_CFunction fn) { lua_pushcfunction(_state, fn); }
+		void set_raw(int i, lua_Integer n) const { lua_rawseti(_state, i, n); }
+		void set_field(int i, const char* k) const { lua_setfield(_state, i, k); }
+		void set_raw_p(int i, const void* p) const { lua_rawsetp(_state, i, p); }
+		void push_c_fn(lua_CFunction fn) const { lua_pushcfunction(_state, fn); }
 		void remove(int i) const { lua_remove(_state, i); }
+		void get_class(int class_ref) const { get_raw(LUA_REGISTRYINDEX, class_ref); }
+
 		void get_class(const std::string& class_name) const
 		{
 			push("mt");
@@ -1172,6 +2712,8 @@ namespace luas
 		template <typename T>
 		T get_global_var(const std::string& name) const
 		{
+			static_assert(!detail::borrows_string<T>(), "Views and pointers of lua strings dangle once the value is popped");
+
 			get_global(name);
 
 			T value;
@@ -1184,30 +2726,90 @@ namespace luas
 		template <typename T>
 		void pop(T& out, int i = -1) const
 		{
+			static_assert(!detail::borrows_string<T>(), "Views and pointers of lua strings dangle once the value is popped");
+
 			_pop(out, i);
 			pop_n();
 		}
 
-		template <typename T>
+		template <typename T, typename P = checked>
 		int pop_read(T& out, int i = -1) const
 		{
-			_pop(out, i);
+			if constexpr (std::is_same_v<P, trusted> && (detail::is_integer_or_bool<T> || std::is_floating_point_v<T>))
+				out = to_trusted<T>(i++);
+			else _pop(out, i);
+
 			return i;
 		}
 
+		/*
+		* reads the argument at i for a parameter of type T and passes it
+		* to fn along with the index of the next argument. registered
+		* classes taken by reference are bound to their userdata and
+		* trailing optionals can be left out by the caller
+		*/
+		template <typename T, typename P, typename Fn>
+		int read_arg(int i, Fn&& fn) const
+		{
+			using type = detail::remove_cvref_t<T>;
+
+			if constexpr (detail::is_object_ref<T>)
+			{
+				if (const auto obj = to_object<type>(i))
+					return fn(*obj, i + 1);
+
+				return 0;
+			}
+			else
+			{
+				type value;
+
+				// arguments are indexed from the top (negative) or from
+				// the bottom of the stack, i is past the last one when
+				// it reaches 0 or the top
+
+				if constexpr (detail::type_mask<type>() & detail::type_bit(LUA_TNONE))
+					if (i > 0 ? i > get_top() : i == 0)
+					{
+						if constexpr (detail::is_variant<type>)
+							value.template emplace<std::monostate>();
+
+						return fn(std::move(value), i);
+					}
+
+				const int next = pop_read<type, P>(value, i);
+
+				return fn(std::move(value), next);
+			}
+		}
+
 		int push_userdata(void* v) const { if (v) lua_pushlightuserdata(_state, v); else push_nil(); return 1; }
 		int push_nil() const { lua_pushnil(_state); return 1; }
 		int push_value(int i) const { lua_pushvalue(_state, i); return 1; }
 		int get_top() const { return lua_gettop(_state); }
+		int abs_index(int i) const { return lua_absindex(_state, i); }
+		int get_type(int i) const { return lua_type(_state, i); }
+		bool check_stack(int n) const { return lua_checkstack(_state, n); }
 		int get_field(int i, const char* k) const { return lua_getfield(_state, i, k); }
 		int ref() const { return luaL_ref(_state, LUA_REGISTRYINDEX); }
-		int get_raw(int i, int n) const { return lua_rawgeti(_state, i, n); }
+		int get_raw(int i, lua_Integer n) const { return lua_rawgeti(_state, i, n); }
 		int get_raw(int i) const { return lua_rawget(_state, i); }
+		int get_raw_p(int i, const void* p) const { return lua_rawgetp(_state, i, p); }
 		int upvalue_index(int i) const { return lua_upvalueindex(i); }
 		int next(int i) const { return lua_next(_state, i); }
 
 		lua_Unsigned raw_len(int i) const { return lua_rawlen(_state, i); }
 
+		uint32_t get_type_bits(int i) const
+		{
+			const auto type = lua_type(_state, i);
+
+			if (type == LUA_TNUMBER && lua_isinteger(_state, i))
+				return detail::type_bit(type) | detail::integer_bit;
+
+			return detail::type_bit(type);
+		}
+
 		bool is_table(int i) const { return lua_istable(_state, i); }
 		bool is_function(int i) const { return lua_isfunction(_state, i); }
 		bool is_nil(int i) const { return lua_isnil(_state, i); }
@@ -1235,27 +2837,168 @@ namespace luas
 			if (!lua_isnumber(_state, i))
 				return { throw_error<T>("Expected 'number' value, got '{}'", LUA_GET_TYPENAME(i)), false };
 
-			return { static_cast<T>(lua_tonumber(_state, i)), true };
+			return { static_cast<T>(lua_tonumber(_state, i)), true };
+		}
+
+		value_ok<std::string> to_string(int i) const
+		{
+			const auto [str, ok] = to_string_view(i);
+
+			return { std::string(str), ok };
+		}
+
+		value_ok<std::string_view> to_string_view(int i) const
+		{
+			size_t len = 0;
+
+			if (const auto str = lua_tolstring(_state, i, &len))
+				return { { str, len }, true };
+
+			return { throw_error<std::string_view>("Expected 'string' value, got '{}'", LUA_GET_TYPENAME(i)), false };
+		}
+
+		/*
+		* single call conversion used by the trusted policy, the type
+		* is validated through the isnum out value unless it's disabled
+		*/
+		template <typename T>
+		T to_trusted(int i) const
+		{
+			if constexpr (detail::is_bool<T>)
+			{
+				if (LUAS_VALIDATE_TRUSTED && !lua_isboolean(_state, i))
+					return throw_error<T>("Expected 'bool' value, got '{}'", LUA_GET_TYPENAME(i));
+
+				return !!lua_toboolean(_state, i);
+			}
+			else
+			{
+				int ok = 1;
+
+				const auto isnum = LUAS_VALIDATE_TRUSTED ? &ok : nullptr;
+
+				T value;
+
+				if constexpr (detail::is_integer<T>)
+					value = static_cast<T>(lua_tointegerx(_state, i, isnum));
+				else
+					value = static_cast<T>(lua_tonumberx(_state, i, isnum));
+
+				if (!ok)
+					return throw_error<T>("Expected '{}' value, got '{}'", detail::is_integer<T> ? "integer" : "number", LUA_GET_TYPENAME(i));
+
+				return value;
+			}
+		}
+
+		template <typename T = void*>
+		T to_userdata(int i) const
+		{
+			if (is_nil(i))
+				return nullptr;
+
+			if (!lua_isuserdata(_state, i) && !lua_islightuserdata(_state, i))
+				return throw_error<T>("Expected '{}' value, got '{}'", typeid(T).name(), LUA_GET_TYPENAME(i));
+
+			return reinterpret_cast<T>(lua_touserdata(_state, i));
+		}
+
+		/*
+		* object held by a full userdata, the metatable is compared with
+		* the class' one when T is registered
+		*/
+		template <typename T>
+		T* to_object(int i) const
+		{
+			if (get_type(i) == LUA_TUSERDATA)
+			{
+				// userdata of unregistered classes can't be told apart
+
+				const auto class_info = get_info()->template get_class<T>();
+
+				if (class_info && lua_getmetatable(_state, i))
+				{
+					get_class(class_info->ref);
+
+					const bool same_class = lua_rawequal(_state, -1, -2);
+
+					pop_n();
+
+					if (same_class)
+					{
+						pop_n();
+
+						return static_cast<T*>(lua_touserdata(_state, i));
+					}
+
+					// objects of derived classes have the offset of T, references
+					// have the offset of T in the object they point to
+
+					if (get_raw_p(-1, class_info) == LUA_TNUMBER)
+					{
+						const auto offset = lua_tointeger(_state, -1);
+						const bool is_ref = get_raw_p(-2, TYPEINFO(object_ref)) != LUA_TNIL;
+
+						pop_n(3);
+
+						const auto obj = is_ref ? ref_target(i) : lua_touserdata(_state, i);
+
+						return obj ? reinterpret_cast<T*>(static_cast<char*>(obj) + offset) : nullptr;
+					}
+
+					pop_n(2);
+				}
+			}
+
+			return throw_error<T*>("Expected '{}' object, got '{}'", typeid(T).name(), LUA_GET_TYPENAME(i));
 		}
 
-		value_ok<std::string> to_string(int i) const
+		/*
+		* object pointed by an object_ref userdata, the metatable is
+		* checked since the accessors can be called with anything
+		*/
+		void* ref_target(int i) const
 		{
-			if (!lua_isstring(_state, i))
-				return { throw_error<std::string>("Expected 'string' value, got '{}'", LUA_GET_TYPENAME(i)), false };
+			if (get_type(i) == LUA_TUSERDATA && lua_getmetatable(_state, i))
+			{
+				const bool is_ref = get_raw_p(-1, TYPEINFO(object_ref)) != LUA_TNIL;
+
+				pop_n(2);
 
-			return { lua_tostring(_state, i), true };
+				if (is_ref)
+				{
+					const auto ref = static_cast<object_ref*>(lua_touserdata(_state, i));
+
+					if (const auto obj = ref->get(ref))
+						return obj;
+
+					return throw_error<void*>("Referenced object doesn't exist anymore");
+				}
+			}
+
+			return throw_error<void*>("Expected object reference, got '{}'", LUA_GET_TYPENAME(i));
 		}
 
-		template <typename T = void*>
-		T to_userdata(int i) const
+		/*
+		* a view is only accepted if its metatable is the one of its
+		* exact type, any other userdata would be read as a view
+		*/
+		template <typename T>
+		T* to_array_view(int i) const
 		{
-			if (is_nil(i))
-				return nullptr;
+			if (get_type(i) == LUA_TUSERDATA && lua_getmetatable(_state, i))
+			{
+				get_raw_p(LUA_REGISTRYINDEX, TYPEINFO(T));
 
-			if (!lua_isuserdata(_state, i) && !lua_islightuserdata(_state, i))
-				return throw_error<T>("Expected '{}' value, got '{}'", typeid(T).name(), LUA_GET_TYPENAME(i));
+				const bool same_type = lua_rawequal(_state, -1, -2);
 
-			return reinterpret_cast<T>(lua_touserdata(_state, i));
+				pop_n(2);
+
+				if (same_type)
+					return static_cast<T*>(lua_touserdata(_state, i));
+			}
+
+			return throw_error<T*>("Expected '{}' value, got '{}'", typeid(T).name(), LUA_GET_TYPENAME(i));
 		}
 
 		template <typename T>
@@ -1278,7 +3021,15 @@ namespace luas
 		void push_c_closure(T&& value, int n = 1) { lua_pushcclosure(_state, value, n); }
 
 		template <typename T>
-		T* new_userdata() const { return static_cast<T*>(lua_newuserdata(_state, sizeof(T))); }
+		T* upvalue_userdata(int i) const { return static_cast<T*>(lua_touserdata(_state, upvalue_index(i))); }
+
+		template <typename T>
+		T* new_userdata() const
+		{
+			static_assert(alignof(T) <= alignof(detail::userdata_align), "Type is over-aligned for lua userdata");
+
+			return static_cast<T*>(lua_newuserdatauv(_state, sizeof(T), 0));
+		}
 
 		template <typename... A>
 		bool call_safe_fn(const std::string& fn, int nreturns = 0, A&&... args) const
@@ -1295,6 +3046,166 @@ namespace luas
 		}
 
 		bool call_safe(int nreturns, const variadic_args& va) const;
+
+		/*
+		* moves a global out of the globals table into a hidden table so
+		* every assignment to it goes through __newindex, which increases
+		* the globals version. reading it still works through __index.
+		* the metatable _G already has is kept and used for the rest of
+		* the keys
+		*/
+		void watch_global(const std::string& name)
+		{
+			const auto info = get_info();
+
+			if (info->watched_names_ref == LUA_NOREF)
+			{
+				push_table();
+				push_table();
+				get_raw(LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+
+				if (!lua_getmetatable(_state, -1))
+				{
+					push_table();
+					push_value(-1);
+					set_metatable(-3);
+				}
+
+				// stack: names, values, _G, metatable
+
+				push_value(-3);
+				get_field(-2, "__index");
+				push_c_closure(watched_index_function, 2);
+				set_field(-2, "__index");
+
+				push_value(-4);
+				push_value(-4);
+				get_field(-3, "__newindex");
+				push_c_closure(watched_newindex_function, 3);
+				set_field(-2, "__newindex");
+
+				pop_n(2);
+
+				info->watched_values_ref = ref();
+				info->watched_names_ref = ref();
+			}
+
+			get_raw(LUA_REGISTRYINDEX, info->watched_names_ref);
+			push(name);
+
+			if (get_raw(-2) == LUA_TNIL)
+			{
+				pop_n();
+
+				// mark it as watched and move the current value
+
+				push(name);
+				push_bool(true);
+				set_raw(-3);
+
+				get_raw(LUA_REGISTRYINDEX, info->watched_values_ref);
+				get_raw(LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+
+				push(name);
+				push(name);
+				get_raw(-3);
+				set_raw(-4);
+
+				push(name);
+				push_nil();
+				set_raw(-3);
+
+				pop_n(2);
+			}
+			else pop_n();
+
+			pop_n();
+		}
+
+		/*
+		* pushes the current value of a watched global
+		*/
+		void get_watched_global(const std::string& name) const
+		{
+			get_raw(LUA_REGISTRYINDEX, get_info()->watched_values_ref);
+			push(name);
+			get_raw(-2);
+			remove(-2);
+		}
+
+		/*
+		* pops the results of a call into a tuple, the last result
+		* is on top of the stack
+		*/
+		template <typename... T>
+		void pop_results(std::tuple<T...>& out) const
+		{
+			static_assert(!detail::borrows_string<std::tuple<T...>>(), "Views and pointers of lua strings dangle once the results are popped");
+
+			tuple::for_each_reverse(out, [&](auto& item) { pop(item); });
+		}
+
+		/*
+		* calls the function on top of the stack once per tuple of
+		* arguments in 'args', the results of each call are stored in
+		* 'out' (a range of tuples) and the function is popped at the end
+		*/
+		template <typename In, typename Out>
+		bool call_batch(const In& args, Out&& out) const
+		{
+			using result_type = std::ranges::range_value_t<Out>;
+
+			constexpr int nreturns = static_cast<int>(std::tuple_size_v<result_type>);
+
+			const int fn = get_top();
+
+			bool ok = true;
+
+			auto out_it = std::ranges::begin(out);
+
+			for (const auto& item : args)
+			{
+				push_value(fn);
+
+				const int nargs = std::apply([&](const auto&... v) { return push(v...); }, item);
+
+				if (call_protected(nargs, nreturns))
+				{
+					if constexpr (nreturns > 0)
+						pop_results(*out_it);
+				}
+				else
+				{
+					// pop the error message and keep going with the rest
+
+					pop_n();
+
+					ok = false;
+				}
+
+				if constexpr (nreturns > 0)
+					++out_it;
+			}
+
+			pop_n();
+
+			return ok;
+		}
+
+		template <typename In, typename Out>
+		bool call_batch_fn(const std::string& fn, const In& args, Out&& out) const
+		{
+			get_global(fn);
+
+			if (!is_function(-1))
+			{
+				pop_n();
+
+				return throw_error<bool>("Function {} undefined", fn);
+			}
+
+			return call_batch(args, std::forward<Out>(out));
+		}
 	};
 
 	class variadic_args
@@ -1353,16 +3264,15 @@ namespace luas
 			static_assert(detail::is_type_last_in_variadics<variadic_args, A...>::value(), "variadic_args must appear at the end");
 	}
 
-	template <typename Fn>
+	template <typename Fn, typename P = checked>
 	struct lua_c_caller
 	{
-		template <typename... A, typename... In>
-		static int _impl(state& _s, int nargs, [[maybe_unused]] int i, In&&... args) requires (detail::is_empty_args<A>)
+		template <typename... A, typename F, typename... In>
+		static int _impl(state& _s, const F& fn, int nargs, [[maybe_unused]] int i, In&&... args) requires (detail::is_empty_args<A...>)
 		{
 			using return_type = detail::fn_return_type_v<Fn>;
 
 			const auto pop_args = [&]() { if (nargs > 0) _s.pop_n(nargs); };
-			const auto fn = *_s.to_userdata<Fn*>(_s.upvalue_index(1));
 
 			if constexpr (std::is_void_v<return_type>)
 			{
@@ -1371,31 +3281,37 @@ namespace luas
 			}
 			else
 			{
-				const auto ret = fn(args...);
+				auto ret = fn(args...);
 
 				pop_args();
 
+				// the results are moved so returned objects are constructed
+				// straight into their userdata
+
 				if constexpr (detail::is_tuple<return_type>)
 				{
-					tuple::for_each(ret, [&]<typename T>(T&& item) { _s.push(item); });
+					// pairs and tuples inside the tuple push several values
+
+					int nreturns = 0;
+
+					std::apply([&](auto&... item) { ((nreturns += _s.push(std::move(item))), ...); }, ret);
 
-					return std::tuple_size_v<return_type>;
+					return nreturns;
 				}
 				else if constexpr (!std::is_void_v<return_type>)
-					return _s.push(ret);
+					return _s.push(std::move(ret));
 			}
 
 			return 0;
 		}
 
-		template <typename T, typename... A, typename... In>
-		static int _impl(state& _s, int nargs, int i, In&&... args)
+		template <typename T, typename... A, typename F, typename... In>
+		static int _impl(state& _s, const F& fn, int nargs, int i, In&&... args)
 		{
-			using type = detail::remove_cvref_t<T>;
-
-			type value;
-			
-			return _impl<A...>(_s, nargs, _s.pop_read(value, i), std::forward<In>(args)..., std::forward<type>(value));
+			return _s.template read_arg<T, P>(i, [&](auto&& arg, int next)
+			{
+				return _impl<A...>(_s, fn, nargs, next, std::forward<In>(args)..., std::forward<decltype(arg)>(arg));
+			});
 		}
 
 		template <typename T>
@@ -1404,16 +3320,66 @@ namespace luas
 		template <typename R, typename... A>
 		struct caller<R(*)(A...)>
 		{
-			static int _do(state& _s, int i) { variadic_arg_check<A...>(); return _impl<A...>(_s, -i, i); }
+			template <typename F>
+			static int _do(state& _s, const F& fn, int i) { variadic_arg_check<A...>(); return _impl<A...>(_s, fn, -i, i); }
 		};
 
 		template <typename R, typename... A>
 		struct caller<R(*)(state&, A...)>
 		{
-			static int _do(state& _s, int i) { variadic_arg_check<A...>(); return _impl<A...>(_s, -i, i, _s); }
+			template <typename F>
+			static int _do(state& _s, const F& fn, int i) { variadic_arg_check<A...>(); return _impl<A...>(_s, fn, -i, i, _s); }
 		};
 
-		static int call(state& _s, int nargs) { return caller<Fn>::_do(_s, -nargs); }
+		/*
+		* Fn is the function pointer type describing the signature and
+		* F the object that is invoked (function pointer or functor)
+		*/
+		template <typename F>
+		static int call(state& _s, int nargs, const F& fn) { return caller<Fn>::_do(_s, fn, -nargs); }
+	};
+
+	/*
+	* several functions under one name, the first one whose parameters
+	* accept the types of the arguments is called
+	*/
+	template <typename... Fns, typename P>
+	struct lua_c_caller<detail::overload_set<Fns...>, P>
+	{
+		static constexpr int max_arity = std::max({ detail::fn_signature<detail::function_type_v<Fns>>::arity... });
+
+		template <size_t I = 0>
+		static int dispatch(state& _s, int nargs, const uint32_t* types, const detail::overload_set<Fns...>& set)
+		{
+			if constexpr (I < sizeof...(Fns))
+			{
+				using fn_type = detail::function_type_v<std::tuple_element_t<I, std::tuple<Fns...>>>;
+
+				if (detail::fn_signature<fn_type>::match(types, nargs))
+					return lua_c_caller<fn_type, P>::call(_s, nargs, std::get<I>(set.fns));
+
+				return dispatch<I + 1>(_s, nargs, types, set);
+			}
+			else
+			{
+				state::_on_error(_s.get(), "No overload matches the arguments");
+
+				return 0;
+			}
+		}
+
+		static int call(state& _s, int nargs, const detail::overload_set<Fns...>& set)
+		{
+			// type bits of the arguments, only the ones that can be
+			// checked against a signature are needed
+
+			uint32_t types[max_arity + 1] = {};
+
+			for (int i = 0; i < max_arity; ++i)
+				types[i] = i < nargs ? _s.get_type_bits(i + 1) : detail::type_bit(LUA_TNONE);
+
+			return dispatch(_s, nargs, types, set);
+		}
 	};
 
 	struct lua_fn
@@ -1479,10 +3445,108 @@ namespace luas
 			vm.get_raw(LUA_REGISTRYINDEX, ref);
 
 			if (vm.call_safe(sizeof...(T), args...))
-				tuple::for_each_reverse(out, [&]<typename T>(T& item) { item = vm.pop<T>(); });
+				vm.pop_results(out);
 
 			return out;
 		}
+
+		/*
+		* calls the function once per tuple of arguments in 'args'
+		* and stores the results in 'out', see ctx::call_batch
+		*/
+		template <typename In>
+		bool call_batch(const In& args) const
+		{
+			vm.get_raw(LUA_REGISTRYINDEX, ref);
+
+			return vm.call_batch(args, std::span<std::tuple<>>());
+		}
+
+		template <typename In, typename Out>
+		bool call_batch(const In& args, Out&& out) const
+		{
+			vm.get_raw(LUA_REGISTRYINDEX, ref);
+
+			return vm.call_batch(args, std::forward<Out>(out));
+		}
+	};
+
+	/*
+	* handle to a global lua function that keeps a registry reference to
+	* it, the global is watched so the handle resolves the function again
+	* after a script assigns the global (hot reloads etc)
+	*/
+	class global_fn
+	{
+	private:
+
+		state vm {};
+
+		std::string name;
+
+		lua_fn fn;
+
+		uint64_t version = 0;
+
+		bool resolve()
+		{
+			const auto info = vm.get_info();
+
+			if (version == info->globals_version)
+				return fn.valid();
+
+			version = info->globals_version;
+
+			fn.free_ref();
+
+			vm.get_watched_global(name);
+
+			if (vm.is_function(-1))
+				fn = lua_fn(&vm);
+			else vm.pop_n();
+
+			if (!fn)
+				state::_on_error(*vm, FORMATV("Function {} undefined", name));
+
+			return fn.valid();
+		}
+
+	public:
+
+		global_fn() {}
+		global_fn(const state* _vm, const std::string& name) : vm(_vm->get()), name(name), version(_vm->get_info()->globals_version - 1) {}
+		~global_fn() { vm.make_invalid(); }
+
+		global_fn(const global_fn&) = delete;
+		global_fn(global_fn&& other) = default;
+
+		global_fn& operator=(const global_fn&) = delete;
+		global_fn& operator=(global_fn&& other) = default;
+
+		const std::string& get_name() const { return name; }
+
+		template <typename... T, typename... A>
+		auto call(A&&... args)
+		{
+			if constexpr (detail::is_empty_args<T...>)
+			{
+				if (resolve())
+					fn.call(std::forward<A>(args)...);
+			}
+			else
+			{
+				if (!resolve())
+					return std::tuple<T...> {};
+
+				return fn.template call<T...>(std::forward<A>(args)...);
+			}
+		}
+
+		template <typename In>
+		bool call_batch(const In& args) { return resolve() && fn.call_batch(args); }
+
+		template <typename In, typename Out>
+		bool call_batch(const In& args, Out&& out) { return resolve() && fn.call_batch(args, std::forward<Out>(out)); }
 	};
 
 	inline bool state::call_safe(int nreturns, const variadic_args& va) const
@@ -1538,23 +3602,57 @@ namespace luas
 		 * FUNCTIONS
 		 */
 
-		template <typename T, typename Fn>
+		template <typename T, typename P, typename Fn>
 		void register_fn(const char* index, Fn&& fn)
 		{
-			const auto function = [](lua_State* L) -> int
+			using fn_type = std::decay_t<Fn>;
+
+			if constexpr (detail::is_stateless_fn<fn_type>)
 			{
-				state s(L);
+				// captureless lambdas and empty functors are created in place
+				// when called so the function doesn't need any upvalue
 
-				return lua_c_caller<T>::call(s, s.get_top());
-			};
+				vm->push_c_fn([](lua_State* L) -> int
+				{
+					state s(L);
+
+					return lua_c_caller<T, P>::call(s, s.get_top(), fn_type {});
+				});
+			}
+			else
+			{
+				const auto fn_obj_loc = vm->new_userdata<fn_type>();
+
+				check_fatal(fn_obj_loc, "Could not allocate placeholder for function");
+
+				new (fn_obj_loc) fn_type(std::forward<Fn>(fn));
+
+				if constexpr (!std::is_trivially_destructible_v<fn_type>)
+				{
+					// the functor holds state that must be destroyed when
+					// the function is collected
+
+					vm->push_table();
+					vm->push_c_fn([](lua_State* L) -> int
+					{
+						state s(L);
 
-			const auto fn_obj_loc = vm->new_userdata<T>();
+						s.to_userdata<fn_type*>(1)->~fn_type();
 
-			check_fatal(fn_obj_loc, "Could not allocate placeholder for function");
+						return 0;
+					});
+					vm->set_field(-2, "__gc");
+					vm->set_metatable(-2);
+				}
+
+				vm->push_c_closure([](lua_State* L) -> int
+				{
+					state s(L);
 
-			new (fn_obj_loc) T(std::move(fn));
+					return lua_c_caller<T, P>::call(s, s.get_top(), *s.upvalue_userdata<fn_type>(1));
+				});
+			}
 
-			vm->push_c_closure(function);
 			vm->set_global(index);
 		}
 
@@ -1588,6 +3686,12 @@ namespace luas
 
 		lua_State* get_lua_state() const { return vm->get(); }
 
+		/*
+		* destroys the objects of classes registered with
+		* luas::deferred_destroy that were collected since the last flush
+		*/
+		void flush_destructors() { vm->get_info()->flush_deferred(); }
+
 		void exec_string(const std::string& code) { vm->exec_string(code); }
 
 		template <typename... T, typename... A>
@@ -1602,15 +3706,91 @@ namespace luas
 			std::tuple<T...> out {};
 
 			if (vm->call_safe_fn(fn, sizeof...(T), args...))
-				tuple::for_each_reverse(out, [&]<typename T>(T& item) { item = vm->pop<T>(); });
+				vm->pop_results(out);
 
 			return out;
 		}
 
+		/*
+		* calls a lua function once per tuple of arguments in 'args' (any
+		* range of tuples such as std::span<std::tuple<A...>>), the function
+		* is resolved once for the whole batch. the results of each call
+		* are stored in 'out', a range of tuples with at least as many
+		* elements as 'args'
+		*/
+		template <typename In>
+		bool call_batch(const std::string& fn, const In& args)
+		{
+			return vm->call_batch_fn(fn, args, std::span<std::tuple<>>());
+		}
+
+		template <typename In, typename Out>
+		bool call_batch(const std::string& fn, const In& args, Out&& out)
+		{
+			return vm->call_batch_fn(fn, args, std::forward<Out>(out));
+		}
+
+		/*
+		* returns a handle to a global lua function, calling it doesn't
+		* look up the global unless a script assigned it again
+		*/
+		global_fn get_function(const std::string& name)
+		{
+			vm->watch_global(name);
+
+			return global_fn(vm, name);
+		}
+
 		template <typename T>
 		void add_function(const char* index, T&& fn)
 		{
-			register_fn<detail::function_type_v<T>>(index, std::forward<T>(fn));
+			register_fn<detail::function_type_v<std::decay_t<T>>, checked>(index, std::forward<T>(fn));
+		}
+
+		/*
+		* same as above but with an explicit conversion policy, for
+		* example add_function<luas::trusted>(...)
+		*/
+		template <typename P, typename... T>
+		void add_function(const char* index, T&&... fns) requires (detail::is_policy<P>)
+		{
+			if constexpr (sizeof...(T) == 1)
+				register_fn<detail::function_type_v<std::decay_t<T>>..., P>(index, std::forward<T>(fns)...);
+			else
+			{
+				using set_type = detail::overload_set<std::decay_t<T>...>;
+
+				register_fn<set_type, P>(index, set_type { { std::forward<T>(fns)... } });
+			}
+		}
+
+		/*
+		* registers several overloads under the same name, the call is
+		* dispatched by the number and lua types of the arguments
+		*/
+		template <typename... T>
+		void add_function(const char* index, T&&... fns) requires (sizeof...(T) > 1)
+		{
+			using set_type = detail::overload_set<std::decay_t<T>...>;
+
+			register_fn<set_type, checked>(index, set_type { { std::forward<T>(fns)... } });
+		}
+
+		/*
+		* registers a function known at compile time, the generated
+		* lua_CFunction calls it directly without any upvalue
+		*/
+		template <auto F, typename P = checked>
+		void add_function(const char* index)
+		{
+			vm->push_c_fn([](lua_State* L) -> int
+			{
+				state s(L);
+
+				return lua_c_caller<detail::function_type_v<decltype(F)>, P>::call(s, s.get_top(), F);
+			});
+
+			vm->set_global(index);
 		}
 
 		template <typename T>